@@ -0,0 +1,422 @@
+/* See LICENSE file for license details.
+ *
+ * Benchmark harness for sflock, run by "make bench" against Xvfb.
+ *
+ *     bench path/to/sflock-bench
+ *
+ * Locks the display with a benchmark build of sflock, drives it with
+ * XTest and prints the results as one JSON object on stdout. sflock's
+ * own output goes to /dev/null, the harness complains on stderr.
+ */
+#define _XOPEN_SOURCE 700
+#if HAVE_SHADOW_H
+#include <crypt.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/dpms.h>
+
+#define PASSWORD "sflockbench"
+#define SETTING  "$6$sflockbench$"  /* crypt() salt, override with BENCH_SALT */
+#define SAMPLES  50      /* keypresses timed (plus as many BackSpaces) */
+#define MOTIONS  1000    /* pointer motion events injected */
+#define IDLESECS 5       /* how long idle CPU and wakeups are measured */
+#define TIMEOUT  5000    /* ms to wait for anything sflock should do */
+#define BLANKMS  500     /* how long the display must stay off after Escape */
+
+static Display *dpy;
+static Window root;
+static int sw, sh;
+static pid_t lockpid = -1;  /* the locked sflock, once it's known */
+
+static void
+die(const char *errstr, ...) {
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	if (lockpid > 0) kill(lockpid, SIGTERM);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+sleep_ms(int ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Returns the 'p' quantile (0..1) of 'n' samples, sorting them */
+static double
+quantile(double *v, int n, double p) {
+	qsort(v, n, sizeof *v, cmp_double);
+	return v[(int)(p * (n - 1) + 0.5)];
+}
+
+/* Process statistics {{{ */
+/* CPU time (user + system) the process has used so far, in ms */
+static double
+cpu_ms(pid_t pid) {
+	char path[64], line[1024], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", (int)pid);
+	if (!(f = fopen(path, "r")) || !fgets(line, sizeof line, f))
+		die("bench: cannot read %s\n", path);
+	fclose(f);
+	/* The command name can contain anything, skip past it */
+	if (!(p = strrchr(line, ')')) || sscanf(p + 2, "%*c %*d %*d %*d %*d " \
+		"%*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		die("bench: cannot parse %s\n", path);
+	return (utime + stime) * 1e3 / sysconf(_SC_CLK_TCK);
+}
+
+/* Context switches so far, every one of them is a wakeup after a sleep */
+static long
+switches(pid_t pid) {
+	char path[64], line[256];
+	long n, total = 0;
+	FILE *f;
+
+	snprintf(path, sizeof path, "/proc/%d/status", (int)pid);
+	if (!(f = fopen(path, "r")))
+		die("bench: cannot read %s\n", path);
+	while (fgets(line, sizeof line, f))
+		if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1 ||
+			sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1)
+			total += n;
+	fclose(f);
+	return total;
+}
+
+/*
+ * sflock forks to daemonize, so the locked process isn't our child.
+ * Find it by name instead; the benchmark build has a name of its own.
+ */
+static pid_t
+find_locker(const char *path) {
+	const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	char file[300], comm[64];
+	struct dirent *d;
+	pid_t pid = -1;
+	DIR *dir;
+	FILE *f;
+
+	if (!(dir = opendir("/proc")))
+		die("bench: cannot read /proc\n");
+	while (pid == -1 && (d = readdir(dir))) {
+		snprintf(file, sizeof file, "/proc/%s/comm", d->d_name);
+		if (!(f = fopen(file, "r"))) continue;
+		if (fgets(comm, sizeof comm, f)) {
+			comm[strcspn(comm, "\n")] = '\0';
+			if (strncmp(comm, name, 15) == 0) pid = atoi(d->d_name);
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	if (pid == -1)
+		die("bench: cannot find the running %s\n", name);
+	return pid;
+}
+/* }}} */
+
+/* Screen and input helpers {{{ */
+static XImage*
+snapshot(int x, int y, int w, int h) {
+	XImage *img = XGetImage(dpy, root, x, y, w, h, AllPlanes, ZPixmap);
+
+	if (!img) die("bench: cannot read the screen\n");
+	return img;
+}
+
+static int
+same_image(XImage *a, XImage *b) {
+	return memcmp(a->data, b->data, (size_t)a->bytes_per_line * a->height) == 0;
+}
+
+/*
+ * Polls the area of 'before' until it shows something else, returning
+ * the ms that took since 't0'. The resolution is one XGetImage round
+ * trip, which is why the screen is kept small.
+ */
+static double
+wait_change(XImage *before, int x, int y, double t0) {
+	XImage *img;
+	int changed;
+
+	do {
+		img = snapshot(x, y, before->width, before->height);
+		changed = !same_image(before, img);
+		XDestroyImage(img);
+		if (!changed && now_ms() - t0 > TIMEOUT)
+			die("bench: the screen didn't change within %d ms\n", TIMEOUT);
+	} while (!changed);
+	return now_ms() - t0;
+}
+
+static void
+key(KeySym ks) {
+	KeyCode kc = XKeysymToKeycode(dpy, ks);
+
+	if (!kc) die("bench: no keycode for %s\n", XKeysymToString(ks));
+	XTestFakeKeyEvent(dpy, kc, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, kc, False, CurrentTime);
+	XFlush(dpy);
+}
+
+static void
+type(const char *s) {
+	char name[2] = { 0, 0 };
+
+	for (; *s; s++) {
+		name[0] = *s;
+		key(XStringToKeysym(name));
+	}
+}
+/* }}} */
+
+/* Benchmarks {{{ */
+/*
+ * Starts sflock and waits for it to report the lock on its ready fd.
+ * Returns the time to lock as seen from outside, 'internal' gets the
+ * one sflock measured itself.
+ */
+static double
+bench_lock(const char *path, long *internal) {
+	char fdarg[16], line[64];
+	struct pollfd pfd;
+	int fds[2], status, n = 0;
+	double t0;
+	pid_t pid;
+
+	if (pipe(fds) == -1) die("bench: cannot create pipe\n");
+	snprintf(fdarg, sizeof fdarg, "%d", fds[1]);
+	t0 = now_ms();
+	if ((pid = fork()) == -1) die("bench: cannot fork\n");
+	if (pid == 0) {
+		close(fds[0]);
+		if (!freopen("/dev/null", "w", stdout)) _exit(127);
+		execl(path, path, "-R", fdarg, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	while (n < (int)sizeof line - 1 && !memchr(line, '\n', n)) {
+		int r;
+
+		if (poll(&pfd, 1, TIMEOUT) <= 0 ||
+			(r = read(fds[0], line + n, sizeof line - 1 - n)) <= 0)
+			die("bench: %s didn't lock the screen\n", path);
+		n += r;
+	}
+	line[n] = '\0';
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+		WEXITSTATUS(status) != 0)
+		die("bench: %s failed to lock\n", path);
+	if (sscanf(line, "locked %ld", internal) != 1)
+		die("bench: unexpected ready line '%s'\n", line);
+	return now_ms() - t0;
+}
+
+/* CPU use and wakeups per second of the locked, untouched sflock */
+static void
+bench_idle(double *cpu_percent, double *wakeups) {
+	double cpu = cpu_ms(lockpid);
+	long sw0 = switches(lockpid);
+
+	sleep_ms(IDLESECS * 1000);
+	*cpu_percent = (cpu_ms(lockpid) - cpu) / (IDLESECS * 10.0);
+	*wakeups = (double)(switches(lockpid) - sw0) / IDLESECS;
+}
+
+/* Time from a keypress to the password field changing on screen */
+static void
+bench_keys(double *median, double *p95, double *max) {
+	static double v[2 * SAMPLES];
+
+	for (int i = 0; i < 2 * SAMPLES; i++) {
+		XImage *before;
+		double t0;
+
+		/* Give the previous redraw time to settle */
+		sleep_ms(10);
+		before = snapshot(0, 0, sw, sh);
+		t0 = now_ms();
+		key(i < SAMPLES ? XK_a : XK_BackSpace);
+		v[i] = wait_change(before, 0, 0, t0);
+		XDestroyImage(before);
+	}
+	*max = quantile(v, 2 * SAMPLES, 1);
+	*p95 = quantile(v, 2 * SAMPLES, 0.95);
+	*median = quantile(v, 2 * SAMPLES, 0.5);
+}
+
+/* CPU sflock spends on MOTIONS pointer motion events */
+static double
+bench_motion(void) {
+	double cpu = cpu_ms(lockpid);
+
+	for (int i = 0; i < MOTIONS; i++)
+		XTestFakeMotionEvent(dpy, -1, i % sw, (i * 7) % sh, CurrentTime);
+	XSync(dpy, False);
+	sleep_ms(500);
+	return cpu_ms(lockpid) - cpu;
+}
+
+static int
+dpms_level(void) {
+	CARD16 level;
+	BOOL on;
+
+	DPMSInfo(dpy, &level, &on);
+	return on ? level : DPMSModeOn;
+}
+
+/*
+ * Does the display go off for Escape and stay off once the key is up?
+ * -1 if the server can't switch it off. Wakes it up again after.
+ */
+static int
+bench_blank(void) {
+	double t0;
+	int off;
+
+	if (!DPMSCapable(dpy)) return -1;
+	key(XK_Escape);
+	for (t0 = now_ms(); dpms_level() != DPMSModeOff; sleep_ms(1))
+		if (now_ms() - t0 > TIMEOUT) return 0;
+	sleep_ms(BLANKMS);
+	off = dpms_level() == DPMSModeOff;
+	XTestFakeMotionEvent(dpy, -1, 0, 0, CurrentTime);
+	XSync(dpy, False);
+	for (t0 = now_ms(); dpms_level() == DPMSModeOff; sleep_ms(1))
+		if (now_ms() - t0 > TIMEOUT)
+			die("bench: motion didn't switch the display back on\n");
+	return off;
+}
+
+/* Return to the error background showing up for a wrong password */
+static double
+bench_wrong(void) {
+	XImage *before;
+	double t, t0;
+
+	type("wrong");
+	sleep_ms(100);
+	/* The top left corner is background, it turns red */
+	before = snapshot(0, 0, 1, 1);
+	t0 = now_ms();
+	key(XK_Return);
+	t = wait_change(before, 0, 0, t0);
+	XDestroyImage(before);
+	return t;
+}
+
+/* Return to sflock letting go of the keyboard for the right password */
+static double
+bench_unlock(void) {
+	double t0;
+
+	type(PASSWORD);
+	sleep_ms(100);
+	t0 = now_ms();
+	key(XK_Return);
+	while (XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync, \
+		CurrentTime) != GrabSuccess) {
+		if (now_ms() - t0 > TIMEOUT)
+			die("bench: the right password didn't unlock\n");
+		sleep_ms(1);
+	}
+	t0 = now_ms() - t0;
+	XUngrabKeyboard(dpy, CurrentTime);
+	XSync(dpy, False);
+	return t0;
+}
+/* }}} */
+
+int
+main(int argc, char **argv) {
+	double lock, cpu, wakeups, median, p95, max, motion, wrong, unlock;
+	const char *salt = getenv("BENCH_SALT") ? getenv("BENCH_SALT") : SETTING;
+	const char *hash;
+	int ev, err, major, minor, blank;
+	long internal;
+
+	if (argc != 2)
+		die("usage: bench path/to/sflock-bench\n");
+	if (!(dpy = XOpenDisplay(NULL)))
+		die("bench: cannot open display\n");
+	if (!XTestQueryExtension(dpy, &ev, &err, &major, &minor))
+		die("bench: the X server has no XTEST extension\n");
+	root = DefaultRootWindow(dpy);
+	sw = DisplayWidth(dpy, DefaultScreen(dpy));
+	sh = DisplayHeight(dpy, DefaultScreen(dpy));
+
+	/* sflock-bench takes the hash from here instead of /etc/shadow */
+	if (!(hash = crypt(PASSWORD, salt)) || hash[0] == '*')
+		die("bench: crypt() doesn't support salt '%s'\n", salt);
+	setenv("SFLOCK_BENCH_HASH", hash, 1);
+
+	lock = bench_lock(argv[1], &internal);
+	lockpid = find_locker(argv[1]);
+	sleep_ms(500);
+	bench_idle(&cpu, &wakeups);
+	bench_keys(&median, &p95, &max);
+	motion = bench_motion();
+	blank = bench_blank();
+	wrong = bench_wrong();
+	unlock = bench_unlock();
+	lockpid = -1;
+
+	printf("{\n" \
+		"\t\"screen\": \"%dx%d\",\n" \
+		"\t\"time_to_lock_ms\": %.2f,\n" \
+		"\t\"time_to_lock_internal_ms\": %ld,\n" \
+		"\t\"idle_cpu_percent\": %.3f,\n" \
+		"\t\"idle_wakeups_per_sec\": %.2f,\n" \
+		"\t\"keypress_to_pixel_ms\": " \
+		"{ \"median\": %.2f, \"p95\": %.2f, \"max\": %.2f },\n" \
+		"\t\"motion_cpu_ms_per_%d_events\": %.2f,\n" \
+		"\t\"escape_stays_off\": %s,\n" \
+		"\t\"auth_wrong_ms\": %.2f,\n" \
+		"\t\"auth_unlock_ms\": %.2f\n" \
+		"}\n", sw, sh, lock, internal, cpu, wakeups, median, p95, max, \
+		MOTIONS, motion, blank < 0 ? "null" : blank ? "true" : "false", \
+		wrong, unlock);
+	XCloseDisplay(dpy);
+	return 0;
+}
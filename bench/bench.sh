@@ -0,0 +1,23 @@
+#!/bin/sh
+# Runs the sflock benchmarks on a private Xvfb, see bench.c.
+# usage: bench.sh path/to/sflock-bench path/to/bench
+# BENCH_DISPLAY and BENCH_SCREEN pick the Xvfb display and its size.
+
+display=${BENCH_DISPLAY:-:99}
+screen=${BENCH_SCREEN:-640x480x24}
+
+command -v Xvfb >/dev/null || { echo "bench: Xvfb is not installed" >&2; exit 1; }
+
+Xvfb "$display" -screen 0 "$screen" -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null' EXIT INT TERM
+
+# Wait for the server to take connections
+i=0
+until [ -e "/tmp/.X11-unix/X${display#:}" ]; do
+	i=$((i + 1))
+	[ $i -gt 50 ] && { echo "bench: Xvfb didn't start" >&2; exit 1; }
+	sleep 0.1
+done
+
+DISPLAY=$display "$2" "$1"
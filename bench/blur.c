@@ -0,0 +1,99 @@
+/* See LICENSE file for license details.
+ *
+ * Benchmark of the --blur and --pixelate kernels, run by "make bench".
+ *
+ *     blur [width height [radius [block]]]
+ *
+ * Filters a noisy image of the given size (4K by default) a few times and
+ * prints the fastest run of each kernel as one JSON object on stdout. No X
+ * server is needed.
+ */
+#define _XOPEN_SOURCE 700
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+
+#include "../img.h"
+
+#define RUNS 5
+
+static double
+now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+fill(struct image *img) {
+	uint32_t seed = 2463534242u;
+
+	for (size_t i = 0; i < (size_t)img->w * img->h; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		img->data[i] = seed | 0xff000000;
+	}
+}
+
+/* Fastest of RUNS runs of the kernel, in ms */
+static double
+bench(struct image *img, int blur, int arg) {
+	double best = -1;
+
+	for (int i = 0; i < RUNS; i++) {
+		double t;
+
+		fill(img);
+		t = now_ms();
+		if (blur) {
+			if (img_blur(img, arg) == -1) {
+				fprintf(stderr, "blur: out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else {
+			img_pixelate(img, arg);
+		}
+		t = now_ms() - t;
+		if (best < 0 || t < best) best = t;
+	}
+	return best;
+}
+
+int
+main(int argc, char **argv) {
+	struct image img;
+	int radius = 10, block = 16;
+	double blur, pixelate;
+
+	img.w = argc > 2 ? atoi(argv[1]) : 3840;
+	img.h = argc > 2 ? atoi(argv[2]) : 2160;
+	if (argc > 3) radius = atoi(argv[3]);
+	if (argc > 4) block = atoi(argv[4]);
+	if (img.w < 1 || img.h < 1 || \
+		!(img.data = malloc((size_t)img.w * img.h * 4))) {
+		fprintf(stderr, "usage: blur [width height [radius [block]]]\n");
+		return EXIT_FAILURE;
+	}
+
+	blur = bench(&img, 1, radius);
+	pixelate = bench(&img, 0, block);
+	printf("{\n" \
+		"\t\"image\": \"%dx%d\",\n" \
+		"\t\"cpus\": %ld,\n" \
+		"\t\"blur_radius\": %d,\n" \
+		"\t\"blur_ms\": %.2f,\n" \
+		"\t\"blur_mpixels_per_sec\": %.1f,\n" \
+		"\t\"pixelate_block\": %d,\n" \
+		"\t\"pixelate_ms\": %.2f\n" \
+		"}\n", img.w, img.h, sysconf(_SC_NPROCESSORS_ONLN), radius, blur, \
+		(double)img.w * img.h / blur / 1e3, block, pixelate);
+	img_free(&img);
+	return 0;
+}
@@ -0,0 +1,409 @@
+/* See LICENSE file for license details.
+ *
+ * Layout and paint path of sflock on the software renderer, run by
+ * "make bench". No X server is needed.
+ *
+ *     render [font [frame.ff]]
+ *
+ * Lays the prompt out for a set of option combinations, checks where
+ * every element ended up and prints it, then times full repaints and per
+ * keystroke repaints at growing resolutions, and the repaint of one
+ * changed line of a long name panel. Everything goes to stdout as one JSON
+ * object, failed layout checks go to stderr and make the exit status 1
+ * ("make check" only looks at those). The checks only hold the elements to
+ * where the options put them and to each other, so they pass with any
+ * font. Built with STATIC_LAYOUT, only the layout config.h fixes is run
+ * and checked. The 1920x1080 frame on the solid background can be saved as a
+ * farbfeld image to look at.
+ */
+#define _XOPEN_SOURCE 700
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
+
+#include "../config.h"
+#include "../img.h"
+#include "../render.h"
+#include "../layout.h"
+
+#define RUNS 5    /* full repaints timed, the fastest counts */
+#define KEYS 200  /* keystrokes timed */
+#define PANEL 40  /* lines of the name panel, one of them changing */
+#define SLACK 4   /* px a glyph's bearing may move text off its origin */
+
+/* Checks 'c' about the layout of option set 'i' on 'n' outputs */
+#define CHECK(c) do { \
+		if (!(c)) { \
+			fprintf(stderr, "render: %s on %d outputs: %s fails\n", \
+				option_names[i], n, #c); \
+			failed = 1; \
+		} \
+	} while (0)
+
+static char passdisp[64];
+static int passlen = 8;
+static int failed;
+
+void
+password_text(char **text, int *n) {
+	*text = passdisp;
+	*n = passlen;
+}
+
+char *
+widget_text(int el) {
+	return el == ElClock ? "12:34" : el == ElHost ? "sflock-host" : "";
+}
+
+/* Every keystroke lights the next segment, like sflock does */
+int
+indicator_frame(void) {
+	return IndKey + passlen * 3 % RINGSEGS;
+}
+
+static double
+now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* 'n' outputs of 'w' x 'h' side by side, the prompt on the last one */
+static void
+set_screen(int w, int h, int n) {
+	for (int i = 0; i < n; i++) {
+		XRectangle r = { i * w, 0, w, h };
+
+		outputs[i] = r;
+	}
+	noutputs = n;
+	sw = w * n;
+	sh = h;
+	prompt_output = n - 1;
+	ox = outputs[prompt_output].x;
+	oy = outputs[prompt_output].y;
+	width = w;
+	height = h;
+}
+
+static const char *option_names[] = {
+	"default", "-x 100 -y 200", "-A 10 -E 40 -C 300 -F 500", "-X 250 -L 600",
+	"-t %H:%M -H --hostname-pos 20,30 -g 100", "-N (3 lines) -g 100"
+};
+
+static const char *panel_names[] = {
+	"sflock", "sflock", "sflock", "sflock", "sflock",
+	"on call: ops team\nasset 4711\nthis machine is locked"
+};
+
+/* A static layout can't be changed, only the one config.h fixes is run */
+#ifdef STATIC_LAYOUT
+#define NOPTIONS 1
+#else
+#define NOPTIONS (sizeof option_names / sizeof *option_names)
+#endif
+
+static void
+set_options(int i) {
+#ifndef STATIC_LAYOUT
+	use_x = use_y = use_line_length = x_shift = 0;
+	use_name_x = use_name_y = use_line_x = use_line_y = 0;
+	use_password_x = use_password_y = 0;
+	show_clock = show_host = use_widget_pos[ElHost] = show_indicator = 0;
+	switch (i) {
+	case 1: /* -x 100 -y 200 */
+		use_x = use_y = 1;
+		new_x = 100;
+		new_y = 200;
+		break;
+	case 2: /* -A 10 -E 40 -C 300 -F 500 */
+		use_name_x = use_line_y = use_password_x = use_password_y = 1;
+		new_name_x = 10;
+		new_line_y = 40;
+		new_password_x = 300;
+		new_password_y = 500;
+		break;
+	case 3: /* -X 250 -L 600 */
+		x_shift = 250;
+		use_line_length = 1;
+		new_line_length = 600;
+		break;
+	case 4: /* -t %H:%M -H --hostname-pos 20,30 -g 100 */
+		show_clock = show_host = use_widget_pos[ElHost] = 1;
+		show_indicator = 1;
+		new_widget_x[ElHost] = 20;
+		new_widget_y[ElHost] = 30;
+		break;
+	case 5: /* -N (3 lines) -g 100 */
+		show_indicator = 1;
+		break;
+	}
+#endif
+	set_name(panel_names[i], strlen(panel_names[i]));
+}
+
+static void
+print_layout(const char *options, int n) {
+	static const char *el_names[ElLast] = {
+		"name", "line", "password", "clock", "date", "hostname", "battery",
+		"indicator"
+	};
+
+	printf("\t\t{ \"options\": \"%s\", \"outputs\": %d", options, n);
+	for (int i = 0; i < ElLast; i++) {
+		struct element *e = &elements[i];
+
+		if (!*e->show) continue;
+		printf(", \"%s\": [%d, %d, %d, %d]", el_names[i], \
+			e->r.x, e->r.y, e->r.width, e->r.height);
+	}
+	printf(" }");
+}
+
+static int
+inside(const XRectangle *r) {
+	return r->x >= ox && r->y >= oy && r->x + r->width <= ox + width && \
+		r->y + r->height <= oy + height;
+}
+
+static int
+overlap(const XRectangle *a, const XRectangle *b) {
+	return a->x < b->x + b->width && b->x < a->x + a->width && \
+		a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/*
+ * Holds the layout of option set 'i' on 'n' outputs to what the options
+ * ask for. 'def' is the default layout on the same outputs.
+ */
+static void
+check_layout(int i, int n, const struct element *def) {
+	const struct element *name = &elements[ElName], *line = &elements[ElLine];
+	const struct element *pass = &elements[ElPassword];
+
+	for (int j = 0; j < ElLast; j++) {
+		if (!*elements[j].show) continue;
+		CHECK(inside(&elements[j].r));
+		/* -x/-y and the -A to -F ones stack fields on purpose */
+		if (i == 1 || i == 2) continue;
+		for (int k = j + 1; k < ElLast; k++)
+			if (*elements[k].show)
+				CHECK(!overlap(&elements[j].r, &elements[k].r));
+	}
+	if (i != 1 && i != 2) {
+		/* name above the line, password below it */
+		CHECK(name->r.y + name->r.height <= line->r.y);
+		CHECK(pass->r.y >= line->r.y + line->r.height);
+	}
+	switch (i) {
+	case 1: /* -x 100 -y 200 */
+		CHECK(line->r.x == ox + 100 && line->r.y == oy + 200);
+		CHECK(pass->x == ox + 100 && pass->y == oy + 200);
+		CHECK(abs(name->r.x - (ox + 100)) <= SLACK && name->y == oy + 200);
+		break;
+	case 2: /* -A 10 -E 40 -C 300 -F 500 */
+		CHECK(abs(name->r.x - (ox + 10)) <= SLACK);
+		CHECK(name->y == def[ElName].y);
+		CHECK(line->r.x == def[ElLine].r.x && line->r.y == oy + 40);
+		CHECK(pass->x == ox + 300 && pass->y == oy + 500);
+		break;
+	case 3: /* -X 250 -L 600 */
+		CHECK(line->r.width == 601);
+		CHECK(line->r.x == def[ElLine].r.x + 250);
+		CHECK(name->r.x == def[ElName].r.x + 250);
+		CHECK(pass->x == def[ElPassword].x + 250);
+		break;
+	case 4: /* -t %H:%M -H --hostname-pos 20,30 -g 100 */
+		CHECK(elements[ElHost].x == ox + 20 && elements[ElHost].y == oy + 30);
+		CHECK(elements[ElClock].r.y >= pass->r.y + pass->r.height);
+		CHECK(elements[ElIndicator].r.width == indicator_size);
+		CHECK(elements[ElIndicator].r.y + indicator_size <= name->r.y);
+		break;
+	case 5: /* -N (3 lines) -g 100 */
+		CHECK(name->r.height >= 3 * (rnd->ascent + rnd->descent) - SLACK);
+		CHECK(elements[ElIndicator].r.y + indicator_size <= name->r.y);
+		break;
+	}
+	if (i != 1 && i != 2 && i != 3) {
+		CHECK(abs(name->r.x + name->r.width / 2 - (ox + width / 2)) <= SLACK);
+		CHECK(line->r.x == def[ElLine].r.x && pass->x == def[ElPassword].x);
+	}
+}
+
+/* Fills 'img' with noise, standing in for a background image */
+static int
+noise(struct image *img, int w, int h) {
+	uint32_t seed = 2463534242u;
+
+	if (!(img->data = malloc((size_t)w * h * 4))) return -1;
+	img->w = w;
+	img->h = h;
+	for (size_t i = 0; i < (size_t)w * h; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		img->data[i] = seed | 0xff000000;
+	}
+	return 0;
+}
+
+/*
+ * Average repaint of a PANEL line name panel when one of its lines
+ * changes, in ms. Puts the one line name back afterwards.
+ */
+static double
+time_panel(void) {
+	static char text[PANEL * 32];
+	char *line;
+	double t;
+	int n = 0;
+
+	for (int i = 0; i < PANEL; i++)
+		n += sprintf(text + n, "%2d: nothing to see here\n", i);
+	/* The digits of the middle line change */
+	line = text + PANEL / 2 * (n / PANEL);
+	set_name(text, n);
+	update_screen();
+	t = now_ms();
+	for (int i = 0; i < KEYS; i++) {
+		line[0] = '0' + i % 10;
+		set_name(text, n);
+		update_screen();
+	}
+	t = (now_ms() - t) / KEYS;
+	set_name("sflock", 6);
+	update_screen();
+	return t;
+}
+
+/* Fastest full repaint and the average keystroke, in ms */
+static void
+time_paint(double *full, double *key) {
+	double t;
+
+	*full = -1;
+	for (int i = 0; i < RUNS; i++) {
+		damage_rect(0, 0, sw, sh);
+		t = now_ms();
+		update_screen();
+		t = now_ms() - t;
+		if (*full < 0 || t < *full) *full = t;
+	}
+	t = now_ms();
+	for (int i = 0; i < KEYS; i++) {
+		passlen = i % 17;
+		relayout(ElPassword);
+		relayout(ElIndicator);
+		update_screen();
+	}
+	*key = (now_ms() - t) / KEYS;
+	passlen = 8;
+	relayout(ElPassword);
+	relayout(ElIndicator);
+	update_screen();
+}
+
+static int
+write_farbfeld(const char *path, const struct image *img) {
+	unsigned char hdr[16] = "farbfeld";
+	FILE *f;
+
+	if (!(f = fopen(path, "wb"))) return -1;
+	for (int i = 0; i < 4; i++) {
+		hdr[8 + i] = img->w >> (24 - 8 * i);
+		hdr[12 + i] = img->h >> (24 - 8 * i);
+	}
+	fwrite(hdr, 1, sizeof hdr, f);
+	for (size_t i = 0; i < (size_t)img->w * img->h; i++) {
+		uint32_t p = img->data[i];
+		unsigned char px[8] = {
+			p >> 16, p >> 16, p >> 8, p >> 8, p, p, p >> 24, p >> 24
+		};
+
+		fwrite(px, 1, sizeof px, f);
+	}
+	return fclose(f);
+}
+
+int
+main(int argc, char **argv) {
+	static const int sizes[][2] = {
+		{ 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 }
+	};
+	const char *font = argc > 1 ? argv[1] : "Helvetica:bold:size=12";
+	static struct element def[ElLast];
+	struct image tile;
+	double full, key, line;
+
+	memset(passdisp, '*', sizeof passdisp);
+	damage = XCreateRegion();
+#ifndef STATIC_LAYOUT
+	indicator_size = 100;
+#endif
+	if (!(rnd = soft_open(1920, 1080, font))) {
+		fprintf(stderr, "render: cannot open font %s\n", font);
+		return EXIT_FAILURE;
+	}
+	if (noise(&tile, 256, 256) == -1) {
+		fprintf(stderr, "render: out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("{\n\t\"font\": \"%s\",\n\t\"ascent\": %d,\n\t\"descent\": %d,\n" \
+		"\t\"layouts\": [\n", font, rnd->ascent, rnd->descent);
+	for (int n = 1; n <= 2; n++) {
+		set_screen(1920, 1080, n);
+		for (int i = 0; i < NOPTIONS; i++) {
+			set_options(i);
+			relayout_all();
+			if (i == 0) memcpy(def, elements, sizeof def);
+			check_layout(i, n, def);
+			print_layout(option_names[i], n);
+			printf(n == 2 && i == NOPTIONS - 1 ? "\n" : ",\n");
+		}
+	}
+	set_options(0);
+	soft_close();
+
+	printf("\t],\n\t\"paints\": [\n");
+	for (int i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+		if (!(rnd = soft_open(sizes[i][0], sizes[i][1], font))) {
+			fprintf(stderr, "render: out of memory\n");
+			return EXIT_FAILURE;
+		}
+		set_screen(sizes[i][0], sizes[i][1], 1);
+		/* Keystrokes repaint the password and a -g 100 indicator */
+#ifndef STATIC_LAYOUT
+		show_indicator = 1;
+#endif
+		if (show_indicator && rnd->atlas(indicator_size) == -1) {
+			fprintf(stderr, "render: out of memory\n");
+			return EXIT_FAILURE;
+		}
+		relayout_all();
+		for (int tiled = 0; tiled <= 1; tiled++) {
+			soft_background(0xff000000, tiled ? &tile : NULL);
+			time_paint(&full, &key);
+			line = time_panel();
+			printf("\t\t{ \"size\": \"%dx%d\", \"background\": \"%s\", " \
+				"\"full_ms\": %.3f, \"key_ms\": %.4f, \"panel_line_ms\": " \
+				"%.4f }%s\n", sizes[i][0], sizes[i][1], \
+				tiled ? "tiled" : "solid", full, key, line, \
+				i == sizeof sizes / sizeof *sizes - 1 && tiled ? "" : ",");
+			if (argc > 2 && i == 0 && !tiled && \
+				write_farbfeld(argv[2], soft_framebuffer()) != 0)
+				fprintf(stderr, "render: cannot write %s\n", argv[2]);
+		}
+		soft_close();
+	}
+	printf("\t]\n}\n");
+	img_free(&tile);
+	XDestroyRegion(damage);
+	return failed ? EXIT_FAILURE : 0;
+}
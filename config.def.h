@@ -0,0 +1,56 @@
+/* See LICENSE file for license details. */
+
+/*
+ * Build time configuration. make copies this file to config.h if there
+ * is no config.h yet; edit config.h and rebuild. Everything below is a
+ * default the command line overrides, unless STATIC_LAYOUT is defined.
+ */
+
+/* Theme (-f, -c, -i, -e, -M, -T, -b, -k, -I) */
+#define FONT          "Helvetica:bold:size=12" /* Xft pattern or XLFD */
+#define PASSCHAR      "*"
+#define TEXT_COLOR    "white"
+#define BG_COLOR      "black"      /* without a background image */
+#define ERROR_COLOR   "orange red" /* without an error image */
+#define BG_IMAGE      ""           /* path, "" for none */
+#define ERROR_IMAGE   ""
+#define IMAGE_MODE    ModeTile     /* ModeCenter, ModeFit, ModeFill... */
+#define ERROR_TIME    0            /* ms the error background shows, 0 stays */
+#define BLUR_RADIUS   0
+#define PIXEL_SIZE    0
+#define IDLE_TIME     0            /* s before dimming, 0 never dims */
+
+/* Elements shown (-n, -l, -p, -o, -t, -u, -H, -K, -g) */
+#define SHOW_NAME      1
+#define SHOW_LINE      1
+#define SHOW_PASSWORD  1
+#define SHOW_CLOCK     0
+#define CLOCK_FMT      "%H:%M"     /* strftime format */
+#define SHOW_DATE      0
+#define DATE_FMT       "%A %d %B"
+#define SHOW_HOST      0
+#define SHOW_BATTERY   0
+#define INDICATOR_SIZE 0           /* 16 to 400, 0 hides the indicator */
+
+/*
+ * Placement (-x, -y, -X, -A to -F, -L). Coordinates are relative to the
+ * prompt output, -1 keeps the default place.
+ */
+#define POS_X          -1          /* all fields, unless set below */
+#define POS_Y          -1
+#define SHIFT_X        0
+#define NAME_X         -1
+#define NAME_Y         -1
+#define LINE_X         -1
+#define LINE_Y         -1
+#define PASSWORD_X     -1
+#define PASSWORD_Y     -1
+#define LINE_LENGTH    -1          /* -1 is a quarter of the output */
+
+/*
+ * Uncomment to fix the elements and their placement at build time. The
+ * layout then folds down to the places above and paints from a static
+ * draw list holding only the elements shown, and the options that would
+ * change any of that are refused.
+ */
+/* #define STATIC_LAYOUT */
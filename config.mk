@@ -12,12 +12,25 @@ MANPREFIX = /usr/share/man
 X11INC = /usr/X11R6/include
 X11LIB = /usr/X11R6/lib
 
+# Xft
+FREETYPEINC = /usr/include/freetype2
+FREETYPELIBS = -lfontconfig -lfreetype -lXft -lXrender
+
+# image decoders
+IMGLIBS = -lpng -ljpeg
+
+# benchmark harness (make bench)
+BENCHLIBS = -lXtst
+
 # includes and libs
-INCS = -I. -I/usr/include -I${X11INC}
-LIBS = -L/usr/lib -lc -lcrypt -L${X11LIB} -lX11 -lXext -lXpm
+INCS = -I. -I/usr/include -I${X11INC} -I${FREETYPEINC}
+LIBS = -L/usr/lib -lc -lm -lcrypt -lpthread -L${X11LIB} -lX11 -lX11-xcb -lxcb -lXext -lXrandr -lXpm ${FREETYPELIBS} ${IMGLIBS}
 
 # flags
 CPPFLAGS = -DVERSION=\"${VERSION}\" -DHAVE_SHADOW_H
+# Uncomment for stage latency histograms and counters, dumped to stderr
+# (or $SFLOCK_STATS) on SIGUSR1 and at exit, plus the debug output
+#CPPFLAGS += -DSTATS
 CFLAGS = -std=c99 -pedantic -Wall -Os ${INCS} ${CPPFLAGS}
 LDFLAGS = -s ${LIBS}
 
@@ -0,0 +1,1333 @@
+/* See LICENSE file for license details. */
+#define _XOPEN_SOURCE 500
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <png.h>
+#include <jpeglib.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/xpm.h>
+#include <X11/extensions/XShm.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "img.h"
+
+#define MAXTHREADS 8
+
+/* A slice of rows of 'dst' for one thread to compute from 'src' */
+struct job {
+	const struct image *src;
+	struct image *dst;
+	const int *xs0, *xs1;       /* source columns left/right of each dst column */
+	const unsigned char *xf;    /* weight of the right one, 0..255 */
+	int r;                      /* filter radius or block size */
+	void (*fn)(struct job *j, int y0, int y1);
+	int y0, y1;
+};
+
+static const char *modes[] = { "tile", "center", "fit", "fill", "stretch" };
+
+/* Returns the Mode* value called 'name', -1 if there is none */
+int
+img_mode(const char *name) {
+	for (int i = 0; i < sizeof modes / sizeof modes[0]; i++)
+		if (strcmp(name, modes[i]) == 0) return i;
+	return -1;
+}
+
+static int
+alloc_image(struct image *img, int w, int h) {
+	img->data = NULL;
+	if (w <= 0 || h <= 0 || (size_t)w > SIZE_MAX / 4 / h)
+		return -1;
+	if (!(img->data = malloc((size_t)w * h * 4)))
+		return -1;
+	img->w = w;
+	img->h = h;
+	return 0;
+}
+
+void
+img_free(struct image *img) {
+	free(img->data);
+	img->data = NULL;
+}
+
+/* Decoders {{{ */
+static int
+load_png(const char *path, struct image *img) {
+	png_image png;
+	unsigned char *b;
+
+	memset(&png, 0, sizeof png);
+	png.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&png, path))
+		return -1;
+	png.format = PNG_FORMAT_RGBA;
+	if (alloc_image(img, png.width, png.height) == -1) {
+		png_image_free(&png);
+		return -1;
+	}
+	if (!png_image_finish_read(&png, NULL, img->data, 0, NULL)) {
+		img_free(img);
+		return -1;
+	}
+
+	/* RGBA bytes to native 0xAARRGGBB words, in place */
+	b = (unsigned char *)img->data;
+	for (size_t i = 0; i < (size_t)img->w * img->h; i++, b += 4)
+		img->data[i] = (uint32_t)b[3] << 24 | (uint32_t)b[0] << 16 | \
+			(uint32_t)b[1] << 8 | b[2];
+	return 0;
+}
+
+struct jpeg_err {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+/* libjpeg's default error handler exit()s, jump back to load_jpeg instead */
+static void
+jpeg_fail(j_common_ptr cinfo) {
+	longjmp(((struct jpeg_err *)cinfo->err)->jmp, 1);
+}
+
+static int
+load_jpeg(const char *path, struct image *img) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_err err;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb")))
+		return -1;
+	img->data = NULL;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_fail;
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		img_free(img);
+		return -1;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+	if (alloc_image(img, cinfo.output_width, cinfo.output_height) == -1)
+		longjmp(err.jmp, 1);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		uint32_t *dst = img->data + (size_t)cinfo.output_scanline * img->w;
+		unsigned char *b = (unsigned char *)dst;
+		JSAMPROW row = b;
+
+		/*
+		 * Decode the RGB scanline straight into the destination row and
+		 * widen it to 0xffRRGGBB back to front, so nothing is overwritten
+		 * before it is read.
+		 */
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		for (int x = img->w - 1; x >= 0; x--)
+			dst[x] = 0xff000000u | (uint32_t)b[3 * x] << 16 | \
+				(uint32_t)b[3 * x + 1] << 8 | b[3 * x + 2];
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+	return 0;
+}
+
+static uint32_t
+be32(const unsigned char *b) {
+	return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | \
+		(uint32_t)b[2] << 8 | b[3];
+}
+
+/* farbfeld: "farbfeld", BE32 width, BE32 height, then BE16 RGBA pixels */
+static int
+load_farbfeld(const char *path, struct image *img) {
+	unsigned char hdr[16], *row = NULL;
+	FILE *f;
+	int ret = -1;
+
+	if (!(f = fopen(path, "rb")))
+		return -1;
+	if (fread(hdr, 1, sizeof hdr, f) != sizeof hdr || \
+		memcmp(hdr, "farbfeld", 8) != 0 || \
+		be32(hdr + 8) > INT32_MAX || be32(hdr + 12) > INT32_MAX || \
+		alloc_image(img, be32(hdr + 8), be32(hdr + 12)) == -1)
+		goto out;
+	if (!(row = malloc((size_t)img->w * 8)))
+		goto out;
+
+	for (int y = 0; y < img->h; y++) {
+		uint32_t *dst = img->data + (size_t)y * img->w;
+
+		if (fread(row, 8, img->w, f) != (size_t)img->w)
+			goto out;
+		/* Keep the high byte of every 16 bit channel */
+		for (int x = 0; x < img->w; x++)
+			dst[x] = (uint32_t)row[8 * x + 6] << 24 | \
+				(uint32_t)row[8 * x] << 16 | \
+				(uint32_t)row[8 * x + 2] << 8 | row[8 * x + 4];
+	}
+	ret = 0;
+out:
+	if (ret == -1)
+		img_free(img);
+	free(row);
+	fclose(f);
+	return ret;
+}
+
+/* Scales the bits of 'p' selected by 'mask' to 0..255 */
+static uint32_t
+channel(unsigned long p, unsigned long mask) {
+	int shift = 0, bits = 0;
+
+	if (!mask)
+		return 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		shift++;
+	}
+	while (mask & 1) {
+		mask >>= 1;
+		bits++;
+	}
+	p = (p >> shift) & ((1UL << bits) - 1);
+	return bits >= 8 ? p >> (bits - 8) : p * 255 / ((1UL << bits) - 1);
+}
+
+/* The inverse of channel(): places the 0..255 value 'c' into 'mask' */
+static unsigned long
+unchannel(uint32_t c, unsigned long mask) {
+	int shift = 0, bits = 0;
+
+	if (!mask)
+		return 0;
+	while (!(mask >> shift & 1))
+		shift++;
+	while (mask >> (shift + bits) & 1)
+		bits++;
+	return (unsigned long)(bits >= 8 ? c << (bits - 8) : c >> (8 - bits)) << shift;
+}
+
+/* The old path: libXpm, for .xpm files and anything not recognised above */
+static int
+load_xpm(Display *dpy, const char *path, struct image *img) {
+	XImage *xi;
+
+	if (XpmReadFileToImage(dpy, (char *)path, &xi, NULL, NULL) != XpmSuccess)
+		return -1;
+	if (alloc_image(img, xi->width, xi->height) == -1) {
+		XDestroyImage(xi);
+		return -1;
+	}
+	for (int y = 0; y < img->h; y++) {
+		for (int x = 0; x < img->w; x++) {
+			unsigned long p = XGetPixel(xi, x, y);
+
+			img->data[(size_t)y * img->w + x] = 0xff000000u | \
+				channel(p, xi->red_mask) << 16 | \
+				channel(p, xi->green_mask) << 8 | channel(p, xi->blue_mask);
+		}
+	}
+	XDestroyImage(xi);
+	return 0;
+}
+
+/*
+ * Decodes the PNG, JPEG, farbfeld or XPM file at 'path' into 'img'.
+ * The format is picked by the file's magic bytes. Returns 0 on success,
+ * -1 if the file couldn't be read or decoded.
+ */
+int
+img_load(Display *dpy, const char *path, struct image *img) {
+	unsigned char magic[8] = { 0 };
+	FILE *f;
+
+	if (!(f = fopen(path, "rb")))
+		return -1;
+	if (fread(magic, 1, sizeof magic, f) == 0)
+		magic[0] = 0;
+	fclose(f);
+
+	if (memcmp(magic, "\x89PNG", 4) == 0)
+		return load_png(path, img);
+	if (magic[0] == 0xff && magic[1] == 0xd8)
+		return load_jpeg(path, img);
+	if (memcmp(magic, "farbfeld", 8) == 0)
+		return load_farbfeld(path, img);
+	return load_xpm(dpy, path, img);
+}
+/* }}} */
+
+/* Resampler {{{ */
+/*
+ * Pixels are blended as two 0x00ff00ff lanes in one 32 bit word, so each
+ * lerp handles all four channels with two multiplies. With weights that
+ * sum to 256 a lane never exceeds 0xff00 and can't spill into the next.
+ */
+static inline uint32_t
+lerp(uint32_t a, uint32_t b, unsigned int f) {
+	uint32_t rb = ((a & 0xff00ff) * (256 - f) + (b & 0xff00ff) * f) >> 8;
+	uint32_t ag = ((a >> 8) & 0xff00ff) * (256 - f) + \
+		((b >> 8) & 0xff00ff) * f;
+
+	return (rb & 0xff00ff) | (ag & 0xff00ff00);
+}
+
+/* d[x] = lerp(a[x], b[x], f) for a whole row, four pixels at a time */
+static void
+vblend(const uint32_t *a, const uint32_t *b, uint32_t *d, int n, unsigned int f) {
+	int x = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i wa = _mm_set1_epi16(256 - f), wb = _mm_set1_epi16(f);
+
+	for (; x + 4 <= n; x += 4) {
+		__m128i pa = _mm_loadu_si128((const __m128i *)(a + x));
+		__m128i pb = _mm_loadu_si128((const __m128i *)(b + x));
+		__m128i lo = _mm_add_epi16( \
+			_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa), \
+			_mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb));
+		__m128i hi = _mm_add_epi16( \
+			_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa), \
+			_mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb));
+
+		_mm_storeu_si128((__m128i *)(d + x), _mm_packus_epi16( \
+			_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif
+	for (; x < n; x++)
+		d[x] = lerp(a[x], b[x], f);
+}
+
+static void
+hscale(const struct job *j, const uint32_t *src, uint32_t *d) {
+	for (int x = 0; x < j->dst->w; x++)
+		d[x] = lerp(src[j->xs0[x]], src[j->xs1[x]], j->xf[x]);
+}
+
+/* Bilinear: each dst row is a blend of two horizontally scaled src rows */
+static void
+scale_rows(struct job *j, int y0, int y1) {
+	const struct image *s = j->src;
+	struct image *d = j->dst;
+	uint32_t *r0 = malloc((size_t)d->w * 4), *r1 = malloc((size_t)d->w * 4), *t;
+	int r0y = -1, r1y = -1;
+
+	if (!r0 || !r1) {
+		/* Leave the band black rather than fail the whole image */
+		memset(d->data + (size_t)y0 * d->w, 0, (size_t)(y1 - y0) * d->w * 4);
+		goto out;
+	}
+	for (int y = y0; y < y1; y++) {
+		/* Centre of this dst row in src coordinates, 8 bits of fraction */
+		long long fy = (2LL * y + 1) * s->h * 256 / (2LL * d->h) - 128;
+		int sy0, sy1;
+
+		if (fy < 0) fy = 0;
+		sy0 = fy >> 8;
+		sy1 = sy0 + 1 < s->h ? sy0 + 1 : sy0;
+
+		/* Neighbouring dst rows mostly share src rows, reuse those */
+		if (sy0 == r1y) {
+			t = r0; r0 = r1; r1 = t;
+			r0y = r1y; r1y = -1;
+		}
+		if (sy0 != r0y) {
+			hscale(j, s->data + (size_t)sy0 * s->w, r0);
+			r0y = sy0;
+		}
+		if (sy1 != r1y) {
+			hscale(j, s->data + (size_t)sy1 * s->w, r1);
+			r1y = sy1;
+		}
+		vblend(r0, r1, d->data + (size_t)y * d->w, d->w, fy & 255);
+	}
+out:
+	free(r0);
+	free(r1);
+}
+
+/* Box filter 2x2 -> 1, used to get big downscales within bilinear range */
+static void
+halve_rows(struct job *j, int y0, int y1) {
+	const struct image *s = j->src;
+	struct image *d = j->dst;
+
+	for (int y = y0; y < y1; y++) {
+		const uint32_t *a = s->data + (size_t)2 * y * s->w, *b = a + s->w;
+		uint32_t *o = d->data + (size_t)y * d->w;
+
+		for (int x = 0; x < d->w; x++) {
+			uint32_t p = a[2 * x], q = a[2 * x + 1], r = b[2 * x], t = b[2 * x + 1];
+			uint32_t rb = (p & 0xff00ff) + (q & 0xff00ff) + \
+				(r & 0xff00ff) + (t & 0xff00ff);
+			uint32_t ag = ((p >> 8) & 0xff00ff) + ((q >> 8) & 0xff00ff) + \
+				((r >> 8) & 0xff00ff) + ((t >> 8) & 0xff00ff);
+
+			o[x] = ((rb >> 2) & 0xff00ff) | ((ag << 6) & 0xff00ff00);
+		}
+	}
+}
+
+static void *
+band(void *arg) {
+	struct job *j = arg;
+
+	j->fn(j, j->y0, j->y1);
+	return NULL;
+}
+
+/* Splits the rows of j->dst into bands and runs 'fn' on them in parallel */
+static void
+run_bands(const struct job *j, void (*fn)(struct job *j, int y0, int y1)) {
+	pthread_t tid[MAXTHREADS];
+	struct job jobs[MAXTHREADS];
+	int started[MAXTHREADS];
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* A thread per core, but not for less than 64 rows each */
+	if (n > j->dst->h / 64) n = j->dst->h / 64;
+	if (n > MAXTHREADS) n = MAXTHREADS;
+	if (n < 1) n = 1;
+
+	for (int i = 0; i < n; i++) {
+		jobs[i] = *j;
+		jobs[i].fn = fn;
+		jobs[i].y0 = j->dst->h * i / n;
+		jobs[i].y1 = j->dst->h * (i + 1) / n;
+		/* The last band runs on this thread, as does any that can't start */
+		started[i] = i < n - 1 && \
+			pthread_create(&tid[i], NULL, band, &jobs[i]) == 0;
+		if (!started[i])
+			band(&jobs[i]);
+	}
+	for (int i = 0; i < n; i++)
+		if (started[i])
+			pthread_join(tid[i], NULL);
+}
+
+/* Resamples 'src' to w x h into 'dst'. Returns -1 if out of memory */
+int
+img_scale(const struct image *src, struct image *dst, int w, int h) {
+	struct image cur = *src, half;
+	struct job j = { 0 };
+	int *xs0 = NULL, *xs1 = NULL, ret = -1;
+	unsigned char *xf = NULL;
+
+	/*
+	 * Bilinear only samples 2x2 source pixels per output pixel, so halve
+	 * big downscales first instead of skipping most of the source.
+	 */
+	while (cur.w >= 2 * w && cur.h >= 2 * h) {
+		if (alloc_image(&half, cur.w / 2, cur.h / 2) == -1)
+			goto out;
+		j.src = &cur;
+		j.dst = &half;
+		run_bands(&j, halve_rows);
+		if (cur.data != src->data)
+			img_free(&cur);
+		cur = half;
+	}
+
+	if (alloc_image(dst, w, h) == -1)
+		goto out;
+	if (!(xs0 = malloc(w * sizeof *xs0)) || !(xs1 = malloc(w * sizeof *xs1)) || \
+		!(xf = malloc(w))) {
+		img_free(dst);
+		goto out;
+	}
+	for (int x = 0; x < w; x++) {
+		long long fx = (2LL * x + 1) * cur.w * 256 / (2LL * w) - 128;
+
+		if (fx < 0) fx = 0;
+		xs0[x] = fx >> 8;
+		xs1[x] = xs0[x] + 1 < cur.w ? xs0[x] + 1 : xs0[x];
+		xf[x] = fx & 255;
+	}
+	j.src = &cur;
+	j.dst = dst;
+	j.xs0 = xs0;
+	j.xs1 = xs1;
+	j.xf = xf;
+	run_bands(&j, scale_rows);
+	ret = 0;
+out:
+	if (cur.data != src->data)
+		img_free(&cur);
+	free(xs0);
+	free(xs1);
+	free(xf);
+	return ret;
+}
+
+/* Copies 'src' into the middle of 'dst', cropping whatever doesn't fit */
+static void
+place(const struct image *src, struct image *dst) {
+	int dx = (dst->w - src->w) / 2, dy = (dst->h - src->h) / 2;
+	int sx = dx < 0 ? -dx : 0, sy = dy < 0 ? -dy : 0;
+	int n = src->w - sx < dst->w ? src->w - sx : dst->w;
+
+	if (dx < 0) dx = 0;
+	if (dy < 0) dy = 0;
+	for (int y = 0; sy + y < src->h && dy + y < dst->h; y++)
+		memcpy(dst->data + (size_t)(dy + y) * dst->w + dx, \
+			src->data + (size_t)(sy + y) * src->w + sx, (size_t)n * 4);
+}
+
+/*
+ * Makes a w x h image of 'src' laid out according to 'mode': centered
+ * unscaled, scaled to fit inside (letterboxed), scaled to fill (cropped)
+ * or stretched. Uncovered parts are black. Returns -1 if out of memory.
+ */
+int
+img_fit(const struct image *src, struct image *dst, int mode, int w, int h) {
+	struct image scaled = *src;
+	int sw = w, sh = h;
+
+	if (mode == ModeStretch)
+		return img_scale(src, dst, w, h);
+
+	/* Is the image wider than the output, relative to their heights? */
+	if (mode == ModeFit || mode == ModeFill) {
+		int wider = (long long)src->w * h > (long long)w * src->h;
+
+		if (wider == (mode == ModeFit))
+			sh = (long long)src->h * w / src->w;
+		else
+			sw = (long long)src->w * h / src->h;
+		if (sw < 1) sw = 1;
+		if (sh < 1) sh = 1;
+		if (img_scale(src, &scaled, sw, sh) == -1)
+			return -1;
+	}
+
+	if (alloc_image(dst, w, h) == -1) {
+		if (scaled.data != src->data)
+			img_free(&scaled);
+		return -1;
+	}
+	memset(dst->data, 0, (size_t)w * h * 4);
+	place(&scaled, dst);
+	if (scaled.data != src->data)
+		img_free(&scaled);
+	return 0;
+}
+/* }}} */
+
+/* Filters {{{ */
+/*
+ * Sums of pixels, one 32 bit lane per channel. With SSE2 the four lanes
+ * of one pixel sit in one register, in the order of the pixel's bytes.
+ */
+#ifdef __SSE2__
+typedef __m128i acc;
+
+static inline acc
+acc_zero(void) {
+	return _mm_setzero_si128();
+}
+
+static inline acc
+acc_px(uint32_t p) {
+	__m128i zero = _mm_setzero_si128();
+
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p), zero), \
+		zero);
+}
+
+static inline acc
+acc_add(acc a, acc b) {
+	return _mm_add_epi32(a, b);
+}
+
+static inline acc
+acc_sub(acc a, acc b) {
+	return _mm_sub_epi32(a, b);
+}
+
+/* The sum times 'inv' (1 / number of pixels summed), rounded */
+static inline uint32_t
+acc_avg(acc a, float inv) {
+	__m128i v = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(a), \
+		_mm_set1_ps(inv)));
+
+	v = _mm_packs_epi32(v, v);
+	return _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+}
+#else
+typedef struct { int32_t c[4]; } acc;
+
+static inline acc
+acc_zero(void) {
+	acc a = { { 0 } };
+
+	return a;
+}
+
+static inline acc
+acc_px(uint32_t p) {
+	acc a;
+
+	for (int k = 0; k < 4; k++)
+		a.c[k] = p >> 8 * k & 0xff;
+	return a;
+}
+
+static inline acc
+acc_add(acc a, acc b) {
+	for (int k = 0; k < 4; k++)
+		a.c[k] += b.c[k];
+	return a;
+}
+
+static inline acc
+acc_sub(acc a, acc b) {
+	for (int k = 0; k < 4; k++)
+		a.c[k] -= b.c[k];
+	return a;
+}
+
+static inline uint32_t
+acc_avg(acc a, float inv) {
+	uint32_t p = 0;
+
+	for (int k = 0; k < 4; k++)
+		p |= (uint32_t)(a.c[k] * inv + 0.5f) << 8 * k;
+	return p;
+}
+#endif
+
+static inline int
+clamp(int v, int lo, int hi) {
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* Box blur of radius j->r along each row, edges extended */
+static void
+hbox_rows(struct job *j, int y0, int y1) {
+	int w = j->src->w, r = j->r;
+	float inv = 1.0f / (2 * r + 1);
+
+	for (int y = y0; y < y1; y++) {
+		const uint32_t *in = j->src->data + (size_t)y * w;
+		uint32_t *out = j->dst->data + (size_t)y * w;
+		acc sum = acc_zero();
+
+		int x = 0;
+
+		for (int i = -r; i <= r; i++)
+			sum = acc_add(sum, acc_px(in[clamp(i, 0, w - 1)]));
+		/* Only the ends need clamping, keep it out of the middle */
+		for (; x < w && (x < r || x + r + 1 >= w); x++) {
+			out[x] = acc_avg(sum, inv);
+			sum = acc_sub(acc_add(sum, acc_px(in[clamp(x + r + 1, 0, w - 1)])), \
+				acc_px(in[clamp(x - r, 0, w - 1)]));
+		}
+		for (; x + r + 1 < w; x++) {
+			out[x] = acc_avg(sum, inv);
+			sum = acc_sub(acc_add(sum, acc_px(in[x + r + 1])), acc_px(in[x - r]));
+		}
+		for (; x < w; x++) {
+			out[x] = acc_avg(sum, inv);
+			sum = acc_sub(acc_add(sum, acc_px(in[w - 1])), acc_px(in[x - r]));
+		}
+	}
+}
+
+/*
+ * One row of the vertical box blur: out[x] is the running sum of column x
+ * times 'inv', then the sum slides down a row, adding add[x] and dropping
+ * sub[x]. The sums are four lanes per pixel, in the order of its bytes.
+ */
+static void
+vbox_row(int32_t *sum, const uint32_t *add, const uint32_t *sub, \
+	uint32_t *out, int w, float inv) {
+	int x = 0;
+#if defined(__AVX2__)
+	__m256 vinv = _mm256_set1_ps(inv);
+
+	for (; x + 4 <= w; x += 4) {
+		__m256i *s = (__m256i *)(sum + 4 * x);
+		__m256i s0 = _mm256_loadu_si256(s), s1 = _mm256_loadu_si256(s + 1);
+		__m256i p = _mm256_packs_epi32( \
+			_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(s0), vinv)), \
+			_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(s1), vinv)));
+
+		/* The packs work per 128 bit lane, put the pixels back in order */
+		p = _mm256_permute4x64_epi64(p, 0xd8);
+		p = _mm256_permute4x64_epi64(_mm256_packus_epi16(p, p), 0xd8);
+		_mm_storeu_si128((__m128i *)(out + x), _mm256_castsi256_si128(p));
+
+		_mm256_storeu_si256(s, _mm256_add_epi32(s0, _mm256_sub_epi32( \
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(add + x))), \
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(sub + x))))));
+		_mm256_storeu_si256(s + 1, _mm256_add_epi32(s1, _mm256_sub_epi32( \
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(add + x + 2))), \
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(sub + x + 2))))));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128 vinv = _mm_set1_ps(inv);
+
+	for (; x + 4 <= w; x += 4) {
+		__m128i *s = (__m128i *)(sum + 4 * x), v[4], p[4];
+		__m128i a = _mm_loadu_si128((const __m128i *)(add + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(sub + x));
+		/* Differences fit 16 bits, sign extend them to 32 */
+		__m128i dlo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), \
+			_mm_unpacklo_epi8(b, zero));
+		__m128i dhi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), \
+			_mm_unpackhi_epi8(b, zero));
+		__m128i d[4] = {
+			_mm_srai_epi32(_mm_unpacklo_epi16(dlo, dlo), 16),
+			_mm_srai_epi32(_mm_unpackhi_epi16(dlo, dlo), 16),
+			_mm_srai_epi32(_mm_unpacklo_epi16(dhi, dhi), 16),
+			_mm_srai_epi32(_mm_unpackhi_epi16(dhi, dhi), 16)
+		};
+
+		for (int i = 0; i < 4; i++) {
+			v[i] = _mm_loadu_si128(s + i);
+			p[i] = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v[i]), vinv));
+			_mm_storeu_si128(s + i, _mm_add_epi32(v[i], d[i]));
+		}
+		_mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16( \
+			_mm_packs_epi32(p[0], p[1]), _mm_packs_epi32(p[2], p[3])));
+	}
+#endif
+	for (; x < w; x++) {
+		uint32_t v = 0;
+
+		for (int k = 0; k < 4; k++) {
+			int32_t *c = sum + 4 * x + k;
+
+			v |= (uint32_t)(*c * inv + 0.5f) << 8 * k;
+			*c += (int32_t)(add[x] >> 8 * k & 0xff) - \
+				(int32_t)(sub[x] >> 8 * k & 0xff);
+		}
+		out[x] = v;
+	}
+}
+
+/*
+ * Box blur of radius j->r down each column. A band keeps a running sum
+ * per column and slides it one row at a time, so every row costs one add
+ * and one subtract per channel whatever the radius.
+ */
+static void
+vbox_rows(struct job *j, int y0, int y1) {
+	const struct image *s = j->src;
+	int w = s->w, h = s->h, r = j->r;
+	int32_t *sum = calloc((size_t)w * 4, sizeof *sum);
+
+	if (!sum) {
+		/* Leave the band unblurred rather than fail the whole image */
+		memcpy(j->dst->data + (size_t)y0 * w, s->data + (size_t)y0 * w, \
+			(size_t)(y1 - y0) * w * 4);
+		return;
+	}
+	for (int i = -r; i <= r; i++) {
+		const uint32_t *row = s->data + (size_t)clamp(y0 + i, 0, h - 1) * w;
+
+		for (int x = 0; x < w; x++)
+			for (int k = 0; k < 4; k++)
+				sum[4 * x + k] += row[x] >> 8 * k & 0xff;
+	}
+	for (int y = y0; y < y1; y++)
+		vbox_row(sum, s->data + (size_t)clamp(y + r + 1, 0, h - 1) * w, \
+			s->data + (size_t)clamp(y - r, 0, h - 1) * w, \
+			j->dst->data + (size_t)y * w, w, 1.0f / (2 * r + 1));
+	free(sum);
+}
+
+/*
+ * Blurs 'img' in place, close to a Gaussian with a standard deviation of
+ * 'radius' pixels: three box blurs, each split into a pass along the rows
+ * and one down the columns. Returns -1 if out of memory.
+ */
+int
+img_blur(struct image *img, int radius) {
+	struct image tmp;
+	struct job j = { 0 };
+
+	if (radius < 1)
+		return 0;
+	if (alloc_image(&tmp, img->w, img->h) == -1)
+		return -1;
+	j.r = radius;
+	for (int pass = 0; pass < 3; pass++) {
+		j.src = img;
+		j.dst = &tmp;
+		run_bands(&j, hbox_rows);
+		j.src = &tmp;
+		j.dst = img;
+		run_bands(&j, vbox_rows);
+	}
+	img_free(&tmp);
+	return 0;
+}
+
+/* Fills each j->r x j->r block starting in rows y0..y1 with its average */
+static void
+pixelate_rows(struct job *j, int y0, int y1) {
+	struct image *d = j->dst;
+	int n = j->r;
+
+	for (int by = (y0 + n - 1) / n * n; by < y1; by += n) {
+		int bh = by + n < d->h ? n : d->h - by;
+
+		for (int bx = 0; bx < d->w; bx += n) {
+			int bw = bx + n < d->w ? n : d->w - bx;
+			uint32_t *p = d->data + (size_t)by * d->w + bx, avg;
+			acc sum = acc_zero();
+
+			for (int y = 0; y < bh; y++)
+				for (int x = 0; x < bw; x++)
+					sum = acc_add(sum, acc_px(p[(size_t)y * d->w + x]));
+			avg = acc_avg(sum, 1.0f / (bw * bh));
+			for (int y = 0; y < bh; y++)
+				for (int x = 0; x < bw; x++)
+					p[(size_t)y * d->w + x] = avg;
+		}
+	}
+}
+
+/* Replaces every 'size' x 'size' block of 'img' by its average color */
+void
+img_pixelate(struct image *img, int size) {
+	struct job j = { 0 };
+
+	if (size < 2)
+		return;
+	j.src = j.dst = img;
+	j.r = size;
+	run_bands(&j, pixelate_rows);
+}
+/* }}} */
+
+/* Upload and disk cache {{{ */
+/*
+ * An image on its way to the server. When the server is local and has
+ * MIT-SHM its pixels live in a shared segment and go over with
+ * XShmPutImage; otherwise they are in malloc()ed memory and go through
+ * the socket with XPutImage.
+ */
+struct upload {
+	XImage *xi;
+	XShmSegmentInfo si;
+	int shm;
+	int borrowed; /* xi->data isn't ours to free, e.g. a cache mapping */
+};
+
+#define MAXSHM 8 /* displays whose MIT-SHM state is kept */
+
+/* Per display: -1 not checked yet, 0 unusable, 1 usable */
+static struct {
+	Display *dpy;
+	int state;
+} shm_displays[MAXSHM];
+static int nshm_displays;
+static int shm_failed;
+
+static int
+native_order(void) {
+	union { uint32_t u; unsigned char c; } endian = { 1 };
+
+	return endian.c ? LSBFirst : MSBFirst;
+}
+
+/* XShmAttach on a remote server fails with BadAccess; note it and move on */
+static int
+shm_error(Display *dpy, XErrorEvent *e) {
+	shm_failed = 1;
+	return 0;
+}
+
+/*
+ * Attaches a new shared segment holding xi's pixels to the server, which
+ * may only read it unless 'writable' (to XShmGetImage into it).
+ */
+static int
+shm_attach(Display *dpy, XImage *xi, XShmSegmentInfo *si, int writable) {
+	XErrorHandler old;
+
+	si->shmid = shmget(IPC_PRIVATE, (size_t)xi->bytes_per_line * xi->height, \
+		IPC_CREAT | 0600);
+	if (si->shmid == -1)
+		return -1;
+	si->shmaddr = xi->data = shmat(si->shmid, NULL, 0);
+	si->readOnly = !writable;
+	if (si->shmaddr == (char *)-1) {
+		shmctl(si->shmid, IPC_RMID, NULL);
+		xi->data = NULL;
+		return -1;
+	}
+
+	shm_failed = 0;
+	old = XSetErrorHandler(shm_error);
+	XShmAttach(dpy, si);
+	XSync(dpy, False);
+	XSetErrorHandler(old);
+	/* The segment is freed once both sides have detached */
+	shmctl(si->shmid, IPC_RMID, NULL);
+	if (shm_failed) {
+		shmdt(si->shmaddr);
+		xi->data = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The MIT-SHM state of 'dpy'. A local display can use it and a remote one
+ * can't, so every display keeps its own. Past MAXSHM displays it's off.
+ */
+static int *
+shm_state(Display *dpy) {
+	static int off;
+	int i;
+
+	for (i = 0; i < nshm_displays && shm_displays[i].dpy != dpy; i++);
+	if (i == nshm_displays) {
+		if (i == MAXSHM) {
+			off = 0;
+			return &off;
+		}
+		shm_displays[i].dpy = dpy;
+		shm_displays[i].state = -1;
+		nshm_displays++;
+	}
+	return &shm_displays[i].state;
+}
+
+/* Is MIT-SHM worth trying on 'dpy'? */
+static int
+shm_usable(Display *dpy) {
+	int *state = shm_state(dpy);
+
+	/* XShmPutImage can't swap bytes, our pixels must be in server order */
+	if (*state == -1)
+		*state = XShmQueryExtension(dpy) && \
+			ImageByteOrder(dpy) == native_order();
+	return *state;
+}
+
+/* Creates the w x h image for an upload, in shared memory if possible */
+static int
+begin_upload(Display *dpy, Visual *vis, int depth, int w, int h, \
+	struct upload *u) {
+	u->shm = u->borrowed = 0;
+	if (shm_usable(dpy) && (u->xi = XShmCreateImage(dpy, vis, depth, \
+		ZPixmap, NULL, &u->si, w, h))) {
+		if (shm_attach(dpy, u->xi, &u->si, 0) == 0) {
+			u->shm = 1;
+			return 0;
+		}
+		XDestroyImage(u->xi);
+		/* Most likely a remote display, don't try again */
+		*shm_state(dpy) = 0;
+	}
+
+	u->xi = XCreateImage(dpy, vis, depth, ZPixmap, 0, NULL, w, h, 32, 0);
+	if (!u->xi)
+		return -1;
+	if (!(u->xi->data = malloc((size_t)u->xi->bytes_per_line * h))) {
+		XDestroyImage(u->xi);
+		return -1;
+	}
+	/* Xlib swaps bytes on upload if the server's order differs from ours */
+	u->xi->byte_order = native_order();
+	return 0;
+}
+
+/* Sends the image to a new Pixmap of 'depth' and frees it */
+static Pixmap
+finish_upload(Display *dpy, Drawable d, int depth, struct upload *u) {
+	XImage *xi = u->xi;
+	Pixmap pm;
+	GC gc;
+
+	pm = XCreatePixmap(dpy, d, xi->width, xi->height, depth);
+	gc = XCreateGC(dpy, pm, 0, NULL);
+	if (u->shm) {
+		XShmPutImage(dpy, pm, gc, xi, 0, 0, 0, 0, xi->width, xi->height, False);
+		/*
+		 * Requests are handled in order, so the server is done reading
+		 * by the time it detaches. Our side can let go right away.
+		 */
+		XShmDetach(dpy, &u->si);
+		shmdt(u->si.shmaddr);
+		xi->data = NULL;
+	}
+	else {
+		XPutImage(dpy, pm, gc, xi, 0, 0, 0, 0, xi->width, xi->height);
+		if (u->borrowed)
+			xi->data = NULL;
+	}
+	XFreeGC(dpy, gc);
+	XDestroyImage(xi);
+	return pm;
+}
+
+/*
+ * Converts 'img' into xi's pixel format, which follows 'vis'. Translucent
+ * pixels are blended onto black.
+ */
+static void
+convert(Visual *vis, const struct image *img, XImage *xi) {
+	int fast = xi->bits_per_pixel == 32 && xi->byte_order == native_order() && \
+		vis->red_mask == 0xff0000 && vis->green_mask == 0xff00 && \
+		vis->blue_mask == 0xff;
+
+	for (int y = 0; y < img->h; y++) {
+		const uint32_t *s = img->data + (size_t)y * img->w;
+		uint32_t *o = (uint32_t *)(xi->data + (size_t)y * xi->bytes_per_line);
+
+		for (int x = 0; x < img->w; x++) {
+			uint32_t p = s[x], a = p >> 24;
+
+			if (a != 0xff)
+				p = lerp(0, p, a + (a >> 7));
+			if (fast)
+				o[x] = p & 0xffffff;
+			else
+				XPutPixel(xi, x, y, unchannel(p >> 16 & 0xff, vis->red_mask) | \
+					unchannel(p >> 8 & 0xff, vis->green_mask) | \
+					unchannel(p & 0xff, vis->blue_mask));
+		}
+	}
+}
+
+/*
+ * Reads the w x h area at x, y of 'root' into 'img', through a shared
+ * segment when MIT-SHM works. Returns -1 on failure.
+ */
+int
+img_capture(Display *dpy, Window root, Visual *vis, int depth, \
+	int x, int y, int w, int h, struct image *img) {
+	XShmSegmentInfo si;
+	XImage *xi = NULL;
+	int shm = 0, fast;
+
+	if (shm_usable(dpy) && (xi = XShmCreateImage(dpy, vis, depth, ZPixmap, \
+		NULL, &si, w, h))) {
+		if (shm_attach(dpy, xi, &si, 1) == 0) {
+			if (XShmGetImage(dpy, root, xi, x, y, AllPlanes))
+				shm = 1;
+			else {
+				XShmDetach(dpy, &si);
+				shmdt(si.shmaddr);
+				xi->data = NULL;
+			}
+		}
+		else {
+			*shm_state(dpy) = 0;
+		}
+		if (!shm) {
+			XDestroyImage(xi);
+			xi = NULL;
+		}
+	}
+	if (!xi && !(xi = XGetImage(dpy, root, x, y, w, h, AllPlanes, ZPixmap)))
+		return -1;
+
+	if (alloc_image(img, w, h) == 0) {
+		fast = xi->bits_per_pixel == 32 && xi->byte_order == native_order() && \
+			vis->red_mask == 0xff0000 && vis->green_mask == 0xff00 && \
+			vis->blue_mask == 0xff;
+		for (int yy = 0; yy < h; yy++) {
+			const uint32_t *s = (uint32_t *)(xi->data + (size_t)yy * xi->bytes_per_line);
+			uint32_t *o = img->data + (size_t)yy * w;
+
+			for (int xx = 0; xx < w; xx++) {
+				unsigned long p;
+
+				if (fast) {
+					o[xx] = s[xx] | 0xff000000;
+					continue;
+				}
+				p = XGetPixel(xi, xx, yy);
+				o[xx] = 0xff000000 | channel(p, vis->red_mask) << 16 | \
+					channel(p, vis->green_mask) << 8 | \
+					channel(p, vis->blue_mask);
+			}
+		}
+	}
+	if (shm) {
+		XShmDetach(dpy, &si);
+		shmdt(si.shmaddr);
+		xi->data = NULL;
+	}
+	XDestroyImage(xi);
+	return img->data ? 0 : -1;
+}
+
+/* Uploads 'img' to a new Pixmap of 'depth' on 'vis' */
+Pixmap
+img_pixmap(Display *dpy, Drawable d, Visual *vis, int depth, \
+	const struct image *img) {
+	struct upload u;
+
+	if (begin_upload(dpy, vis, depth, img->w, img->h, &u) == -1)
+		return None;
+	convert(vis, img, u.xi);
+	return finish_upload(dpy, d, depth, &u);
+}
+
+/*
+ * Like img_pixmap(), but for a depth 32 Pixmap that keeps the alpha
+ * channel, premultiplied as XRender's ARGB32 format wants it.
+ */
+Pixmap
+img_pixmap_argb(Display *dpy, Drawable d, Visual *vis, const struct image *img) {
+	struct upload u;
+	int fast;
+
+	if (begin_upload(dpy, vis, 32, img->w, img->h, &u) == -1)
+		return None;
+	fast = u.xi->bits_per_pixel == 32 && u.xi->byte_order == native_order();
+	for (int y = 0; y < img->h; y++) {
+		const uint32_t *s = img->data + (size_t)y * img->w;
+		uint32_t *o = (uint32_t *)(u.xi->data + (size_t)y * u.xi->bytes_per_line);
+
+		for (int x = 0; x < img->w; x++) {
+			uint32_t a = s[x] >> 24;
+			uint32_t p = (lerp(0, s[x], a + (a >> 7)) & 0xffffff) | a << 24;
+
+			if (fast) o[x] = p;
+			else XPutPixel(u.xi, x, y, p);
+		}
+	}
+	return finish_upload(dpy, d, 32, &u);
+}
+
+/*
+ * Cache files hold an image already fitted to an output and converted to
+ * the visual's pixel format, so a hit is an mmap() and an XPutImage().
+ * The file name is a hash of everything but the source file's mtime and
+ * size; those are checked against the header, and a stale file is simply
+ * overwritten by the next img_cache_put().
+ */
+#define CACHE_MAGIC "sflock1"
+#define CACHE_DATA 4096 /* pixel data starts on its own page */
+
+struct cache_hdr {
+	char magic[8];
+	char path[1024];
+	int64_t mtime, size;
+	int32_t mode, w, h;       /* the request: mode and output size */
+	int32_t iw, ih;           /* the stored image */
+	int32_t depth, bpp, bpl, byte_order;
+	uint64_t red, green, blue;
+};
+
+/* Fills 'hdr' with the key for this request and 'file' with its cache file */
+static int
+cache_key(const char *path, int mode, int w, int h, Visual *vis, int depth, \
+	int bpp, struct cache_hdr *hdr, char *file, size_t filelen) {
+	const char *dir = getenv("XDG_CACHE_HOME"), *sub = "sflock";
+	uint64_t hash = 14695981039346656037ull;
+	struct stat st;
+
+	if (strlen(path) >= sizeof hdr->path || stat(path, &st) == -1)
+		return -1;
+	memset(hdr, 0, sizeof *hdr);
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+	strcpy(hdr->path, path);
+	hdr->mtime = st.st_mtime;
+	hdr->size = st.st_size;
+	hdr->mode = mode;
+	hdr->w = w;
+	hdr->h = h;
+	hdr->depth = depth;
+	hdr->bpp = bpp;
+	hdr->red = vis->red_mask;
+	hdr->green = vis->green_mask;
+	hdr->blue = vis->blue_mask;
+
+	/* Everything but the mtime and size goes into the name */
+	for (const unsigned char *c = (unsigned char *)path; *c; c++)
+		hash = (hash ^ *c) * 1099511628211ull;
+	hash = (hash ^ ((uint64_t)mode << 32 | (uint32_t)w)) * 1099511628211ull;
+	hash = (hash ^ ((uint64_t)h << 32 | (uint32_t)depth)) * 1099511628211ull;
+	hash = (hash ^ ((uint64_t)bpp << 32 | vis->red_mask)) * 1099511628211ull;
+	hash = (hash ^ vis->green_mask << 16 ^ vis->blue_mask) * 1099511628211ull;
+
+	if (!dir || !*dir) {
+		dir = getenv("HOME");
+		sub = ".cache/sflock";
+	}
+	if (!dir || snprintf(file, filelen, "%s/%s/%016llx", dir, sub, \
+		(unsigned long long)hash) >= (int)filelen)
+		return -1;
+	return 0;
+}
+
+/* The bits per pixel the server uses for 'depth' */
+static int
+depth_bpp(Display *dpy, int depth) {
+	XPixmapFormatValues *f;
+	int n, bpp = 0;
+
+	if (!(f = XListPixmapFormats(dpy, &n)))
+		return 0;
+	for (int i = 0; i < n; i++)
+		if (f[i].depth == depth)
+			bpp = f[i].bits_per_pixel;
+	XFree(f);
+	return bpp;
+}
+
+/*
+ * Returns a Pixmap of the file at 'path' fitted to w x h with 'mode' if
+ * the disk cache has an up to date copy, None otherwise.
+ */
+Pixmap
+img_cache_get(Display *dpy, Drawable d, Visual *vis, int depth, \
+	const char *path, int mode, int w, int h) {
+	struct cache_hdr key, *hdr;
+	struct upload u;
+	struct stat st;
+	char file[4096];
+	Pixmap pm = None;
+	void *map;
+	int fd;
+
+	if (cache_key(path, mode, w, h, vis, depth, depth_bpp(dpy, depth), &key, \
+		file, sizeof file) == -1)
+		return None;
+	if ((fd = open(file, O_RDONLY)) == -1)
+		return None;
+	if (fstat(fd, &st) == -1 || st.st_size < CACHE_DATA || \
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return None;
+	}
+	close(fd);
+
+	hdr = map;
+	/* The request fields must match, and the source must be unchanged */
+	if (memcmp(hdr->magic, key.magic, sizeof key.magic) != 0 || \
+		strcmp(hdr->path, key.path) != 0 || hdr->mtime != key.mtime || \
+		hdr->size != key.size || hdr->mode != key.mode || \
+		hdr->w != key.w || hdr->h != key.h || hdr->depth != key.depth || \
+		hdr->bpp != key.bpp || hdr->red != key.red || \
+		hdr->green != key.green || hdr->blue != key.blue || \
+		hdr->iw <= 0 || hdr->ih <= 0 || hdr->bpl <= 0 || \
+		st.st_size < CACHE_DATA + (off_t)hdr->bpl * hdr->ih)
+		goto out;
+
+	/*
+	 * With MIT-SHM the pixels are copied from the mapping into the shared
+	 * segment. Without it the mapping is handed to XPutImage directly.
+	 */
+	if (shm_usable(dpy) && hdr->byte_order == native_order() && \
+		begin_upload(dpy, vis, depth, hdr->iw, hdr->ih, &u) == 0) {
+		int n = hdr->bpl < u.xi->bytes_per_line ? hdr->bpl : u.xi->bytes_per_line;
+
+		for (int y = 0; y < hdr->ih; y++)
+			memcpy(u.xi->data + (size_t)y * u.xi->bytes_per_line, \
+				(char *)map + CACHE_DATA + (size_t)y * hdr->bpl, n);
+		pm = finish_upload(dpy, d, depth, &u);
+	}
+	else if ((u.xi = XCreateImage(dpy, vis, depth, ZPixmap, 0, \
+		(char *)map + CACHE_DATA, hdr->iw, hdr->ih, 32, hdr->bpl))) {
+		u.xi->byte_order = hdr->byte_order;
+		u.shm = 0;
+		u.borrowed = 1;
+		pm = finish_upload(dpy, d, depth, &u);
+	}
+out:
+	munmap(map, st.st_size);
+	return pm;
+}
+
+static void
+mkdirs(char *path) {
+	for (char *c = path + 1; *c; c++) {
+		if (*c == '/') {
+			*c = '\0';
+			mkdir(path, 0700);
+			*c = '/';
+		}
+	}
+}
+
+static int
+write_all(int fd, const void *buf, size_t n) {
+	const char *b = buf;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(fd, b, n)) == -1)
+			return -1;
+		b += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/*
+ * Like img_pixmap(), but also stores the converted image in the disk cache
+ * under the key img_cache_get() looks for. Failing to write the cache is
+ * not an error; the next run will just decode again.
+ */
+Pixmap
+img_cache_put(Display *dpy, Drawable d, Visual *vis, int depth, \
+	const char *path, int mode, int w, int h, const struct image *img) {
+	static const char pad[CACHE_DATA];
+	struct cache_hdr hdr;
+	char file[4096], tmp[4096 + 32];
+	struct upload u;
+	XImage *xi;
+	int fd, ok;
+
+	if (begin_upload(dpy, vis, depth, img->w, img->h, &u) == -1)
+		return None;
+	xi = u.xi;
+	convert(vis, img, xi);
+
+	if (cache_key(path, mode, w, h, vis, depth, xi->bits_per_pixel, &hdr, \
+		file, sizeof file) == -1)
+		goto out;
+	hdr.iw = xi->width;
+	hdr.ih = xi->height;
+	hdr.bpl = xi->bytes_per_line;
+	hdr.byte_order = xi->byte_order;
+
+	/* Write a temporary file and rename it so readers never see half */
+	snprintf(tmp, sizeof tmp, "%s.%ld", file, (long)getpid());
+	mkdirs(tmp);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		goto out;
+	ok = write_all(fd, &hdr, sizeof hdr) == 0 && \
+		write_all(fd, pad, CACHE_DATA - sizeof hdr) == 0 && \
+		write_all(fd, xi->data, (size_t)xi->bytes_per_line * xi->height) == 0;
+	if (close(fd) == -1 || !ok || rename(tmp, file) == -1)
+		unlink(tmp);
+out:
+	return finish_upload(dpy, d, depth, &u);
+}
+/* }}} */
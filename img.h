@@ -0,0 +1,28 @@
+/* See LICENSE file for license details. */
+
+/* How a background image is fitted to each output */
+enum { ModeTile, ModeCenter, ModeFit, ModeFill, ModeStretch };
+
+/* A decoded image, one 0xAARRGGBB pixel per uint32_t, rows packed */
+struct image {
+	int w, h;
+	uint32_t *data;
+};
+
+int img_mode(const char *name);
+int img_load(Display *dpy, const char *path, struct image *img);
+int img_scale(const struct image *src, struct image *dst, int w, int h);
+int img_fit(const struct image *src, struct image *dst, int mode, int w, int h);
+Pixmap img_pixmap(Display *dpy, Drawable d, Visual *vis, int depth, \
+	const struct image *img);
+Pixmap img_pixmap_argb(Display *dpy, Drawable d, Visual *vis, \
+	const struct image *img);
+Pixmap img_cache_get(Display *dpy, Drawable d, Visual *vis, int depth, \
+	const char *path, int mode, int w, int h);
+Pixmap img_cache_put(Display *dpy, Drawable d, Visual *vis, int depth, \
+	const char *path, int mode, int w, int h, const struct image *img);
+int img_blur(struct image *img, int radius);
+void img_pixelate(struct image *img, int size);
+int img_capture(Display *dpy, Window root, Visual *vis, int depth, \
+	int x, int y, int w, int h, struct image *img);
+void img_free(struct image *img);
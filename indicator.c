@@ -0,0 +1,87 @@
+/* See LICENSE file for license details. */
+#define _XOPEN_SOURCE 500
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
+
+#include "img.h"
+#include "render.h"
+
+/*
+ * The keystroke indicator frames, shared by sflock's X11 renderer and the
+ * software one in render.c.
+ */
+
+/* Indicator colors, 0xAARRGGBB */
+#define RING_BASE   0x60ffffff
+#define RING_KEY    0xffffffff
+#define RING_ERASE  0xffff4500  /* the "orange red" of the error background */
+#define RING_VERIFY 0xff4a90d9
+#define INNER       0x80000000
+#define INNER_CAPS  0xa0b35900  /* caps lock on */
+
+/* Puts 'src' over 'dst', 'cover' (0..1) of it, both 0xAARRGGBB */
+static uint32_t
+over(uint32_t dst, uint32_t src, double cover) {
+	double sa = (src >> 24) / 255.0 * cover, da = (dst >> 24) / 255.0;
+	double oa = sa + da * (1 - sa);
+	uint32_t p = (uint32_t)(oa * 255 + 0.5) << 24;
+
+	if (oa <= 0) return 0;
+	for (int shift = 0; shift < 24; shift += 8) {
+		double sc = src >> shift & 0xff, dc = dst >> shift & 0xff;
+
+		p |= (uint32_t)((sc * sa + dc * da * (1 - sa)) / oa + 0.5) << shift;
+	}
+	return p;
+}
+
+/*
+ * Draws every indicator frame, 2 * IndLast of them 'size' pixels square
+ * side by side, into 'atlas'. This runs once at startup; the renderers
+ * only ever copy finished frames out of it afterwards.
+ */
+int
+indicator_atlas(struct image *atlas, int size) {
+	double c = size / 2.0, rout = c - 1, rin = rout - (size < 30 ? 3 : size / 10.0);
+	int n = 2 * IndLast;
+
+	if (size < 8 || (size_t)size * n > 32767 || \
+		!(atlas->data = calloc((size_t)size * n * size, 4)))
+		return -1;
+	atlas->w = size * n;
+	atlas->h = size;
+	for (int f = 0; f < n; f++) {
+		int state = f % IndLast, caps = f >= IndLast;
+
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				double dx = x + 0.5 - c, dy = y + 0.5 - c;
+				double d = sqrt(dx * dx + dy * dy);
+				/* Clockwise from the top, in segments */
+				double a = atan2(dx, -dy) / (2 * M_PI) * RINGSEGS;
+				int seg = (int)(a < 0 ? a + RINGSEGS : a) % RINGSEGS;
+				double ring = fmin(d - rin, rout - d) + 0.5;
+				double inner = rin - 1.5 - d + 0.5;
+				uint32_t color = RING_BASE, p = 0;
+
+				if (state == IndVerify) color = RING_VERIFY;
+				else if (state == IndWrong) color = RING_ERASE;
+				else if (state >= IndErase && seg == state - IndErase)
+					color = RING_ERASE;
+				else if (state >= IndKey && state < IndErase && \
+					seg == state - IndKey)
+					color = RING_KEY;
+				if (inner > 0)
+					p = over(p, caps ? INNER_CAPS : INNER, fmin(inner, 1));
+				if (ring > 0)
+					p = over(p, color, fmin(ring, 1));
+				atlas->data[(size_t)y * atlas->w + f * size + x] = p;
+			}
+		}
+	}
+	return 0;
+}
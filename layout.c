@@ -0,0 +1,737 @@
+/* See LICENSE file for license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
+
+#include "config.h"
+#include "img.h"
+#include "render.h"
+#include "layout.h"
+#include "stats.h"
+
+#ifdef STATIC_LAYOUT
+const int show_name = SHOW_NAME;
+const int show_line = SHOW_LINE;
+const int show_password = SHOW_PASSWORD;
+const int show_clock = SHOW_CLOCK;
+const int show_date = SHOW_DATE;
+const int show_host = SHOW_HOST;
+const int show_battery = SHOW_BATTERY;
+const int show_indicator = INDICATOR_SIZE > 0;
+const int indicator_size = INDICATOR_SIZE;
+int line_length;
+#else
+/* show/hide element variables */
+int show_name = SHOW_NAME;
+int show_line = SHOW_LINE;
+int show_password = SHOW_PASSWORD;
+int show_clock = SHOW_CLOCK;
+int show_date = SHOW_DATE;
+int show_host = SHOW_HOST;
+int show_battery = SHOW_BATTERY;
+int show_indicator = INDICATOR_SIZE > 0;
+int indicator_size = INDICATOR_SIZE;
+/* element variables */
+int use_line_length = LINE_LENGTH >= 0;
+int new_line_length = LINE_LENGTH;
+int line_length;
+/* -x and -y variables */
+int use_x = POS_X >= 0, use_y = POS_Y >= 0;
+int new_x = POS_X, new_y = POS_Y;
+/* --name-[xy], --line-[xy], --password-[xy] variables */
+int use_name_x = NAME_X >= 0, use_name_y = NAME_Y >= 0;
+int use_line_x = LINE_X >= 0, use_line_y = LINE_Y >= 0;
+int use_password_x = PASSWORD_X >= 0, use_password_y = PASSWORD_Y >= 0;
+int new_name_x = NAME_X, new_name_y = NAME_Y;
+int new_line_x = LINE_X, new_line_y = LINE_Y;
+int new_password_x = PASSWORD_X, new_password_y = PASSWORD_Y;
+/* --x-shift and --y-shift variables */
+int x_shift = SHIFT_X, y_shift = 0;
+#endif
+/* --clock-pos, --date-pos, --hostname-pos, --battery-pos, --indicator-pos */
+int use_widget_pos[ElLast];
+int new_widget_x[ElLast], new_widget_y[ElLast];
+/* output (monitor) vars */
+XRectangle outputs[MAXOUTPUTS];
+int noutputs;
+int prompt_output;
+int ox, oy;
+int width, height;
+int sw, sh;
+
+Region damage;
+int update;
+struct renderer *rnd;
+
+static int x, y, mid_y;
+static XGlyphInfo overall;
+/*
+ * Text extents cache. Keyed by the string itself so that retyping or
+ * backspacing over a password length doesn't measure it again.
+ */
+#define EXTENTS_CACHE 64
+static struct extents {
+	char s[64];
+	int n;
+	XGlyphInfo gi;
+} first_cache[EXTENTS_CACHE], *extents_cache = first_cache;
+/*
+ * The name panel. Its text is split at newlines and wrapped to the prompt
+ * output, and every line keeps its own extents and box, so when the text
+ * changes only the lines that differ are measured and repainted.
+ */
+#define PANEL_MARGIN 20  /* kept clear on either side of wrapped lines */
+struct panel_line {
+	const char *s;  /* into panel_text */
+	int n;
+	XGlyphInfo gi;
+	int x, y;
+	XRectangle r;
+};
+static char *panel_text;
+static int panel_len;
+static struct panel_line *lines, *next_lines;
+static int nlines, lines_size, next_size;
+static int wrap_width = -1;  /* what the lines were wrapped to, -1 if stale */
+static int panel_x, panel_y; /* -1 if centered, baseline of the last line */
+
+/* Layout helper functions (layout_name, layout_line, layout_password) {{{ */
+/*
+ * The layout functions work out where an element goes and which part of
+ * the screen it covers. They only run when the element's content or the
+ * screen geometry changes (see relayout()); painting reuses the result.
+ */
+
+/* Measures the UTF-8 string 's' of 'n' bytes into 'gi', using the cache */
+void
+text_extents(char *s, int n, XGlyphInfo *gi) {
+	unsigned int h = 2166136261u;
+	struct extents *e;
+
+	for (int i = 0; i < n; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	e = &extents_cache[h % EXTENTS_CACHE];
+	if (n < sizeof e->s && e->n == n && memcmp(e->s, s, n) == 0) {
+		*gi = e->gi;
+		return;
+	}
+
+	rnd->extents(s, n, gi);
+	if (n < sizeof e->s) {
+		memcpy(e->s, s, n);
+		e->n = n;
+		e->gi = *gi;
+	}
+}
+
+/* Fills 'r' with the box a string measuring 'gi' drawn at (x, y) covers */
+static void
+glyph_rect(int x, int y, const XGlyphInfo *gi, XRectangle *r) {
+	int left, right;
+
+	/* Glyphs may stick out of the advance width on either side */
+	left = x - gi->x < x ? x - gi->x : x;
+	right = x - gi->x + gi->width > x + gi->xOff ? \
+		x - gi->x + gi->width : x + gi->xOff;
+	r->x = left;
+	r->y = y - rnd->ascent;
+	r->width = right - left;
+	r->height = rnd->ascent + rnd->descent;
+}
+
+static void
+text_rect(int x, int y, char *s, int n, XRectangle *r) {
+	text_extents(s, n, &overall);
+	glyph_rect(x, y, &overall, r);
+}
+
+/* Measures line 'k' to be, reusing what the current line 'k' measured */
+static void
+measure_line(int k, const char *s, int n, XGlyphInfo *gi) {
+	if (k < nlines && lines[k].n == n && memcmp(lines[k].s, s, n) == 0)
+		*gi = lines[k].gi;
+	else rnd->extents(s, n, gi);
+}
+
+/*
+ * Bytes of 's' that fit in 'maxw' pixels: up to the last space that
+ * fits, or cut between two characters if the first word alone doesn't.
+ * At least one character, so wrapping always moves on.
+ */
+static int
+fit_prefix(const char *s, int n, int maxw) {
+	XGlyphInfo gi;
+	int fit = 0;
+
+	for (int i = 1; i <= n; i++) {
+		if ((i < n && s[i] != ' ') || s[i - 1] == ' ') continue;
+		rnd->extents(s, i, &gi);
+		if (gi.xOff > maxw) break;
+		fit = i;
+	}
+	if (fit) return fit;
+	for (int i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) == 0x80) continue;
+		rnd->extents(s, i, &gi);
+		if (gi.xOff > maxw) break;
+		fit = i;
+	}
+	if (!fit)
+		while (++fit < n && (s[fit] & 0xc0) == 0x80);
+	return fit;
+}
+
+static void
+add_line(int k, const char *s, int n, const XGlyphInfo *gi) {
+	if (k >= next_size) {
+		int size = next_size ? next_size * 2 : 16;
+		struct panel_line *p = realloc(next_lines, size * sizeof *p);
+
+		/* Out of memory, the panel loses its last lines */
+		if (!p) return;
+		next_lines = p;
+		next_size = size;
+	}
+	next_lines[k].s = s;
+	next_lines[k].n = n;
+	next_lines[k].gi = *gi;
+}
+
+/*
+ * Splits panel_text into lines no wider than 'maxw' into next_lines and
+ * returns how many there are. Only lines that aren't the same as the
+ * current line in their place are measured.
+ */
+static int
+build_lines(int maxw) {
+	const char *end = panel_text + panel_len, *e;
+	XGlyphInfo gi;
+	int k = 0, n, fit, skip, wrapped;
+
+	for (const char *s = panel_text; s < end; s = e + 1) {
+		if (!(e = memchr(s, '\n', end - s))) e = end;
+		n = e - s - (e > s && e[-1] == '\r');
+		measure_line(k, s, n, &gi);
+		for (wrapped = 0; gi.xOff > maxw; wrapped = 1) {
+			fit = fit_prefix(s, n, maxw);
+			for (skip = fit; skip < n && s[skip] == ' '; skip++);
+			while (fit > 0 && s[fit - 1] == ' ') fit--;
+			measure_line(k, s, fit, &gi);
+			add_line(k++, s, fit, &gi);
+			s += skip;
+			n -= skip;
+			measure_line(k, s, n, &gi);
+		}
+		/* Blank lines stay, but not what's left of a wrapped one */
+		if (n > 0 || !wrapped) add_line(k++, s, n, &gi);
+	}
+	return k < next_size ? k : next_size;
+}
+
+/* Makes next_lines the panel's lines */
+static void
+swap_lines(int n) {
+	struct panel_line *p = lines;
+	int size = lines_size;
+
+	lines = next_lines;
+	lines_size = next_size;
+	next_lines = p;
+	next_size = size;
+	nlines = n;
+}
+
+static void
+place_line(int i) {
+	struct panel_line *l = &lines[i];
+	int lx = panel_x >= 0 ? panel_x : (width - l->gi.xOff) / 2;
+
+	l->x = ox + lx + x_shift;
+	l->y = oy + panel_y - (nlines - 1 - i) * (rnd->ascent + rnd->descent);
+	glyph_rect(l->x, l->y, &l->gi, &l->r);
+}
+
+/* Sets the element's box to cover every line */
+static void
+panel_rect(struct element *el) {
+	Region r = XCreateRegion();
+
+	for (int i = 0; i < nlines; i++)
+		XUnionRectWithRegion(&lines[i].r, r, r);
+	XClipBox(r, &el->r);
+	XDestroyRegion(r);
+}
+
+static void
+layout_name(struct element *el) {
+	/*
+	* If the user set a name x value, use that for the x.
+	* If the user did not, use the "override" x if it was set.
+	* If neither were set, use the default value; every line is
+	* centered on the screen. Same applies for the y, except the
+	* default for the y is just above the center of the screen.
+	* That y is the last line's, a longer panel grows upwards.
+	*/
+	int maxw;
+
+	if (use_name_x) panel_x = new_name_x;
+	else if (use_x) panel_x = new_x;
+	else panel_x = -1;
+
+	if (use_name_y) panel_y = new_name_y;
+	else if (use_y) panel_y = new_y;
+	else panel_y = mid_y - rnd->ascent - 20;
+
+	maxw = panel_x >= 0 ? width - panel_x - PANEL_MARGIN : \
+		width - 2 * PANEL_MARGIN;
+	if (maxw < 1) maxw = 1;
+	if (maxw != wrap_width) {
+		swap_lines(build_lines(maxw));
+		wrap_width = maxw;
+	}
+	for (int i = 0; i < nlines; i++) place_line(i);
+	panel_rect(el);
+	el->x = ox + x_shift;
+	el->y = oy + panel_y;
+}
+
+static void
+layout_line(struct element *el) {
+	/*
+	* If the user has set a custom line length, make the line that
+	* length. If the user has NOT set a custom line length, default
+	* to a line 2/8ths the size of the screen.
+	*/
+	if (use_line_length) line_length = new_line_length;
+	else line_length = (width * 2 / 8);
+
+	/*
+	* If the user set a line x value, use that for the x.
+	* If the user did not, use the "override" x if it was set.
+	* If neither were set, use the default value; centered on the
+	* screen. Same applies for the y, except the default for the y
+	* is just above the center of the screen.
+	*/
+	if (use_line_x) x = new_line_x;
+	else if (use_x) x = new_x;
+	else x = (width * 3 / 8);
+
+	if (use_line_y) y = new_line_y;
+	else if (use_y) y = new_y;
+	else y = mid_y - rnd->ascent - 10;
+
+	/*
+	* The line is "anchored" at the top left. So the x given is the
+	* left x coordinate.
+	*/
+	el->x = ox + x + x_shift;
+	el->y = oy + y;
+	el->r.x = el->x;
+	el->r.y = el->y;
+	el->r.width = line_length + 1;
+	el->r.height = 1;
+}
+
+static void
+layout_password(struct element *el) {
+	/*
+	* If the user set a password x, use that for the x.
+	* If the user did not, use the "override" x if it was set.
+	* If neither were set, use the default value; centered on the
+	* screen. Same applies for the y, except the default for the y
+	* is just below the center of the screen.
+	*/
+	char *text;
+	int n;
+
+	password_text(&text, &n);
+	text_extents(text, n, &overall);
+
+	// to do: write comment detailing diff between
+	// width and overall.xOff
+	if (use_password_x) x = new_password_x;
+	else if (use_x) x = new_x;
+	else x = (width - overall.xOff) / 2;
+
+	if (use_password_y) y = new_password_y;
+	else if (use_y) y = new_y;
+	else y = mid_y;
+
+	el->x = ox + x + x_shift;
+	el->y = oy + y;
+	text_rect(el->x, el->y, text, n, &el->r);
+}
+
+static void
+layout_widget(struct element *el) {
+	/*
+	* If the user placed the widget, put it there. If not, widgets
+	* stack up below the password field, one line apart in element
+	* order, and are centered like it unless the "override" x was set.
+	*/
+	int i = el - elements, k = 1;
+	char *text = widget_text(i);
+
+	for (int j = ElClock; j < i; j++)
+		k += *elements[j].show && !use_widget_pos[j];
+	text_extents(text, strlen(text), &overall);
+
+	if (use_widget_pos[i]) {
+		x = new_widget_x[i];
+		y = new_widget_y[i];
+	}
+	else {
+		if (use_x) x = new_x;
+		else x = (width - overall.xOff) / 2;
+
+		if (use_password_y) y = new_password_y;
+		else if (use_y) y = new_y;
+		else y = mid_y;
+		y += k * (rnd->ascent + rnd->descent + 10);
+	}
+
+	el->x = ox + x + x_shift;
+	el->y = oy + y;
+	text_rect(el->x, el->y, text, strlen(text), &el->r);
+}
+
+static void
+layout_indicator(struct element *el) {
+	/*
+	* If the user placed the indicator, put it there. If not, it is
+	* centered above the name field, or the "override" x is its left
+	* edge. It covers the same square whatever frame it shows, so a
+	* keystroke only ever repaints that square.
+	*/
+	int i = el - elements;
+
+	if (use_widget_pos[i]) {
+		x = new_widget_x[i];
+		y = new_widget_y[i];
+	}
+	else {
+		if (use_x) x = new_x;
+		else x = (width - indicator_size) / 2;
+
+		if (use_name_y) y = new_name_y;
+		else if (use_y) y = new_y;
+		else y = mid_y - rnd->ascent - 20;
+		y -= rnd->ascent + 10 + indicator_size;
+		/* Clear of a name panel of several lines */
+		if (show_name && nlines > 1)
+			y -= (nlines - 1) * (rnd->ascent + rnd->descent);
+	}
+
+	el->x = ox + x + x_shift;
+	el->y = oy + y;
+	el->r.x = el->x;
+	el->r.y = el->y;
+	el->r.width = indicator_size;
+	el->r.height = indicator_size;
+}
+/* }}} */
+
+/* Draw helper functions (draw_name, draw_line, draw_password) {{{ */
+/* These paint into the back buffer at the position chosen by layout_*() */
+static void
+draw_name(struct element *el) {
+	/* Draw the lines of the name panel that are damaged */
+	for (int i = 0; i < nlines; i++) {
+		struct panel_line *l = &lines[i];
+
+		if (l->n && XRectInRegion(damage, l->r.x, l->r.y, l->r.width, \
+			l->r.height) != RectangleOut)
+			rnd->text(l->x, l->y, l->s, l->n);
+	}
+}
+
+static void
+draw_line(struct element *el) {
+	rnd->line(el->x, el->x + line_length, el->y);
+}
+
+static void
+draw_password(struct element *el) {
+	char *text;
+	int n;
+
+	password_text(&text, &n);
+	// Draw password entry on the lock screen
+	rnd->text(el->x, el->y, text, n);
+}
+
+static void
+draw_widget(struct element *el) {
+	char *text = widget_text(el - elements);
+
+	rnd->text(el->x, el->y, text, strlen(text));
+}
+
+static void
+draw_indicator(struct element *el) {
+	rnd->sprite(indicator_frame(), el->x, el->y);
+}
+/* }}} */
+
+struct element elements[ElLast] = {
+	/* show             layout            draw */
+	{ &show_name,      layout_name,      draw_name },
+	{ &show_line,      layout_line,      draw_line },
+	{ &show_password,  layout_password,  draw_password },
+	{ &show_clock,     layout_widget,    draw_widget },
+	{ &show_date,      layout_widget,    draw_widget },
+	{ &show_host,      layout_widget,    draw_widget },
+	{ &show_battery,   layout_widget,    draw_widget },
+	{ &show_indicator, layout_indicator, draw_indicator },
+};
+
+#ifdef STATIC_LAYOUT
+/* What config.h shows, the only elements ever laid out and drawn */
+static const int draw_list[] = {
+#if SHOW_NAME
+	ElName,
+#endif
+#if SHOW_LINE
+	ElLine,
+#endif
+#if SHOW_PASSWORD
+	ElPassword,
+#endif
+#if SHOW_CLOCK
+	ElClock,
+#endif
+#if SHOW_DATE
+	ElDate,
+#endif
+#if SHOW_HOST
+	ElHost,
+#endif
+#if SHOW_BATTERY
+	ElBattery,
+#endif
+#if INDICATOR_SIZE > 0
+	ElIndicator,
+#endif
+	ElLast
+};
+#endif
+
+void
+damage_rect(int x, int y, int w, int h) {
+	XRectangle r = { x, y, w, h };
+
+	XUnionRectWithRegion(&r, damage, damage);
+	update = 1;
+}
+
+/*
+ * Lays 'e' out again after its content changed and marks both the area
+ * it used to cover and the area it covers now for repainting.
+ */
+static void
+layout_element(struct element *e) {
+	STAT_START(t);
+	damage_rect(e->r.x, e->r.y, e->r.width, e->r.height);
+	e->layout(e);
+	damage_rect(e->r.x, e->r.y, e->r.width, e->r.height);
+	STAT_END(StLayout, t);
+}
+
+/* Lays element 'el' out again, if it's shown */
+void
+relayout(int el) {
+#ifdef STATIC_LAYOUT
+	for (const int *d = draw_list; *d != el; d++)
+		if (*d == ElLast) return;
+#else
+	if (!*elements[el].show) return;
+#endif
+	layout_element(&elements[el]);
+}
+
+/*
+ * Shows 'n' bytes of 's' in the name panel. When it has as many lines as
+ * before, only the lines whose text changed are measured and repainted;
+ * otherwise they all move and the panel is laid out again.
+ */
+void
+set_name(const char *s, int n) {
+	char *text, *old = panel_text;
+	int k;
+
+	if (panel_text && n == panel_len && memcmp(s, panel_text, n) == 0)
+		return;
+	/* Out of memory, the panel keeps showing the old text */
+	if (!(text = malloc(n ? n : 1))) return;
+	memcpy(text, s, n);
+	panel_text = text;
+	panel_len = n;
+	/* Not laid out yet, or hidden: layout_name() does it all later */
+	if (wrap_width < 0 || !show_name) {
+		nlines = 0;
+		wrap_width = -1;
+		free(old);
+		return;
+	}
+
+	STAT_START(t);
+	k = build_lines(wrap_width);
+	if (k != nlines) {
+		swap_lines(k);
+		free(old);
+		STAT_END(StLayout, t);
+		relayout(ElName);
+		relayout(ElIndicator);
+		return;
+	}
+	for (int i = 0; i < nlines; i++) {
+		struct panel_line *l = &lines[i], *m = &next_lines[i];
+
+		if (m->n != l->n || memcmp(m->s, l->s, m->n) != 0) {
+			damage_rect(l->r.x, l->r.y, l->r.width, l->r.height);
+			l->n = m->n;
+			l->gi = m->gi;
+			l->s = m->s;
+			place_line(i);
+			damage_rect(l->r.x, l->r.y, l->r.width, l->r.height);
+		}
+		else l->s = m->s;
+	}
+	free(old);
+	panel_rect(&elements[ElName]);
+	STAT_END(StLayout, t);
+}
+
+/* Called whenever the prompt output changes; everything moves */
+void
+relayout_all(void) {
+	mid_y = (height + rnd->ascent - rnd->descent) / 2;
+#ifdef STATIC_LAYOUT
+	for (const int *d = draw_list; *d != ElLast; d++)
+		layout_element(&elements[*d]);
+#else
+	for (int i = 0; i < ElLast; i++) relayout(i);
+#endif
+}
+
+/*
+ * Repaints only the damaged part of the screen. The background and every
+ * element touching the damage are composited, clipped to the damage, and
+ * then made visible in one go by the renderer's present().
+ */
+void
+update_screen(void) {
+	XRectangle box;
+
+	update = 0;
+	if (XEmptyRegion(damage)) return;
+	STAT_START(t);
+	STAT_COUNT(CtRedraw);
+	XClipBox(damage, &box);
+	rnd->clip(damage);
+
+	/*
+	 * Fill the background output by output so each monitor gets its own
+	 * scaled image, and a tiled one starts at each monitor's corner
+	 * instead of running across the bezels.
+	 */
+	for (int i = 0; i < noutputs; i++) {
+		Region r = XCreateRegion();
+
+		XUnionRectWithRegion(&outputs[i], r, r);
+		XIntersectRegion(r, damage, r);
+		if (!XEmptyRegion(r)) rnd->background(i, r);
+		XDestroyRegion(r);
+	}
+#ifdef STATIC_LAYOUT
+	for (const int *d = draw_list; *d != ElLast; d++) {
+		struct element *e = &elements[*d];
+#else
+	for (int i = 0; i < ElLast; i++) {
+		struct element *e = &elements[i];
+
+		/* If the user HASN'T set the element to be hidden */
+		if (!*e->show) continue;
+#endif
+		if (XRectInRegion(damage, e->r.x, e->r.y, e->r.width, \
+			e->r.height) != RectangleOut)
+			e->draw(e);
+	}
+	rnd->present(&box);
+
+	XDestroyRegion(damage);
+	damage = XCreateRegion();
+	STAT_END(StRender, t);
+}
+
+/*
+ * A screen's share of the globals above and of the layout's own state.
+ * Screens can use different fonts, so each has its own extents cache.
+ */
+struct layout {
+	XRectangle outputs[MAXOUTPUTS];
+	int noutputs, prompt_output, ox, oy, width, height, sw, sh;
+	Region damage;
+	int update;
+	struct renderer *rnd;
+	int mid_y, line_length;
+	struct extents *extents_cache;
+	char *panel_text;
+	int panel_len;
+	struct panel_line *lines, *next_lines;
+	int nlines, lines_size, next_size, wrap_width, panel_x, panel_y;
+	struct {
+		int x, y;
+		XRectangle r;
+	} geometry[ElLast];
+};
+
+struct layout *
+layout_new(void) {
+	struct layout *l = calloc(1, sizeof *l);
+
+	if (!l) return NULL;
+	if (!(l->extents_cache = calloc(EXTENTS_CACHE, sizeof *extents_cache))) {
+		free(l);
+		return NULL;
+	}
+	l->wrap_width = -1;
+	return l;
+}
+
+/* Copies the current screen's layout into 'from' (if any), then loads 'to' */
+void
+layout_switch(struct layout *from, struct layout *to) {
+#define SYNC(v) (save ? memcpy(&l->v, &v, sizeof v) : memcpy(&v, &l->v, sizeof v))
+	for (int save = 1; save >= 0; save--) {
+		struct layout *l = save ? from : to;
+
+		if (!l) continue;
+		SYNC(outputs); SYNC(noutputs); SYNC(prompt_output);
+		SYNC(ox); SYNC(oy); SYNC(width); SYNC(height); SYNC(sw); SYNC(sh);
+		SYNC(damage); SYNC(update); SYNC(rnd);
+		SYNC(mid_y); SYNC(line_length); SYNC(extents_cache);
+		SYNC(panel_text); SYNC(panel_len);
+		SYNC(lines); SYNC(next_lines);
+		SYNC(nlines); SYNC(lines_size); SYNC(next_size);
+		SYNC(wrap_width); SYNC(panel_x); SYNC(panel_y);
+		for (int i = 0; i < ElLast; i++) {
+			struct element *e = &elements[i];
+
+			if (save) {
+				l->geometry[i].x = e->x;
+				l->geometry[i].y = e->y;
+				l->geometry[i].r = e->r;
+			}
+			else {
+				e->x = l->geometry[i].x;
+				e->y = l->geometry[i].y;
+				e->r = l->geometry[i].r;
+			}
+		}
+	}
+#undef SYNC
+}
@@ -0,0 +1,98 @@
+/* See LICENSE file for license details. */
+
+/*
+ * Placing the name panel, line, password and widgets on the prompt output
+ * and painting the damaged part of the screen. All of it draws through
+ * 'rnd' (see render.h), none of it needs a display. Needs config.h.
+ */
+
+#ifdef STATIC_LAYOUT
+/*
+ * Fixed in config.h: the layout folds down to the configured places and
+ * only draws what config.h shows (see draw_list in layout.c).
+ */
+extern const int show_name, show_line, show_password;
+extern const int show_clock, show_date, show_host, show_battery;
+extern const int show_indicator, indicator_size;
+#define use_line_length (LINE_LENGTH >= 0)
+#define new_line_length LINE_LENGTH
+#define use_x           (POS_X >= 0)
+#define use_y           (POS_Y >= 0)
+#define new_x           POS_X
+#define new_y           POS_Y
+#define use_name_x      (NAME_X >= 0)
+#define use_name_y      (NAME_Y >= 0)
+#define new_name_x      NAME_X
+#define new_name_y      NAME_Y
+#define use_line_x      (LINE_X >= 0)
+#define use_line_y      (LINE_Y >= 0)
+#define new_line_x      LINE_X
+#define new_line_y      LINE_Y
+#define use_password_x  (PASSWORD_X >= 0)
+#define use_password_y  (PASSWORD_Y >= 0)
+#define new_password_x  PASSWORD_X
+#define new_password_y  PASSWORD_Y
+#define x_shift         SHIFT_X
+extern int line_length;
+#else
+/* show/hide element variables */
+extern int show_name, show_line, show_password;
+extern int show_clock, show_date, show_host, show_battery;
+extern int show_indicator, indicator_size;
+/* element variables */
+extern int use_line_length, new_line_length, line_length;
+/* -x and -y variables */
+extern int use_x, use_y, new_x, new_y;
+/* --name-[xy], --line-[xy], --password-[xy] variables */
+extern int use_name_x, use_name_y, new_name_x, new_name_y;
+extern int use_line_x, use_line_y, new_line_x, new_line_y;
+extern int use_password_x, use_password_y, new_password_x, new_password_y;
+/* --x-shift and --y-shift variables */
+extern int x_shift, y_shift;
+#endif
+
+/* output (monitor) vars */
+#define MAXOUTPUTS 16
+extern XRectangle outputs[MAXOUTPUTS]; /* one per active CRTC */
+extern int noutputs;
+extern int prompt_output; /* index of the output the prompt is drawn on */
+extern int ox, oy;        /* origin of the prompt output */
+extern int width, height; /* size of the prompt output */
+extern int sw, sh;        /* size of the whole X screen */
+
+/* retained layout vars */
+struct element {
+	const int *show;
+	void (*layout)(struct element *el);
+	void (*draw)(struct element *el);
+	int x, y;     /* where draw() starts drawing (baseline for text) */
+	XRectangle r; /* the part of the screen the element covers */
+};
+enum { ElName, ElLine, ElPassword, ElClock, ElDate, ElHost, ElBattery, \
+	ElIndicator, ElLast };
+extern struct element elements[ElLast];
+/* --clock-pos, --indicator-pos and the like, indexed by element */
+extern int use_widget_pos[ElLast], new_widget_x[ElLast], new_widget_y[ElLast];
+extern Region damage;  /* parts of the screen that need repainting */
+extern int update;     /* damage isn't empty */
+extern struct renderer *rnd;
+
+/* What the elements show, up to the program using the layout */
+void password_text(char **text, int *n);
+char *widget_text(int el);
+int indicator_frame(void);
+
+void text_extents(char *s, int n, XGlyphInfo *gi);
+void set_name(const char *s, int n);
+void damage_rect(int x, int y, int w, int h);
+void relayout(int el);
+void relayout_all(void);
+void update_screen(void);
+
+/*
+ * For a program laying out several screens: every screen gets a layout
+ * of its own, and layout_switch() makes one of them what the globals
+ * above and all the functions here work on.
+ */
+struct layout *layout_new(void);
+void layout_switch(struct layout *from, struct layout *to);
@@ -0,0 +1,319 @@
+/* See LICENSE file for license details. */
+#define _XOPEN_SOURCE 500
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xregion.h>
+#include <X11/extensions/Xrender.h>
+#include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "img.h"
+#include "render.h"
+#include "layout.h"
+
+/*
+ * The software renderer. It paints into 'fb' the way the X11 one paints
+ * into the back buffer: a solid or image background per output, white
+ * antialiased text from FreeType and 1 pixel lines, all clipped to the
+ * rectangles of the current clip region.
+ */
+
+#define GLYPHS 256  /* rendered glyphs kept, direct mapped by code point */
+
+struct glyph {
+	uint32_t cp;
+	int ok;
+	int left, top;      /* bitmap origin relative to the pen */
+	int w, h, advance;
+	unsigned char *bits;
+};
+
+static struct image fb;
+static FT_Library ft;
+static FT_Face face;
+static struct glyph glyphs[GLYPHS];
+static REGION *clip;
+static uint32_t bg_color = 0xff000000, fg_color = 0xffffffff;
+static const struct image *bg_img;
+static struct image sprites;  /* the indicator atlas */
+static int sprite_size;
+static struct renderer soft;
+
+/* Decodes the code point at 's' (of 'n' bytes left) into 'cp' */
+static int
+utf8_decode(const char *s, int n, uint32_t *cp) {
+	const unsigned char *u = (const unsigned char *)s;
+	int len = u[0] < 0x80 ? 1 : u[0] < 0xe0 ? 2 : u[0] < 0xf0 ? 3 : 4;
+
+	if (len > n) len = n;
+	*cp = len == 1 ? u[0] : u[0] & (0x3f >> (len - 1));
+	for (int i = 1; i < len; i++) *cp = *cp << 6 | (u[i] & 0x3f);
+	return len;
+}
+
+/* Returns the rendered glyph for 'cp', NULL if the font can't draw it */
+static struct glyph *
+glyph(uint32_t cp) {
+	struct glyph *g = &glyphs[cp % GLYPHS];
+	FT_GlyphSlot slot = face->glyph;
+
+	if (g->ok && g->cp == cp) return g;
+	free(g->bits);
+	memset(g, 0, sizeof *g);
+	if (FT_Load_Char(face, cp, FT_LOAD_RENDER) || \
+		slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+		return NULL;
+	g->w = slot->bitmap.width;
+	g->h = slot->bitmap.rows;
+	if (g->w && g->h && !(g->bits = malloc((size_t)g->w * g->h)))
+		return NULL;
+	for (int y = 0; y < g->h; y++)
+		memcpy(g->bits + y * g->w, slot->bitmap.buffer + \
+			y * slot->bitmap.pitch, g->w);
+	g->left = slot->bitmap_left;
+	g->top = slot->bitmap_top;
+	g->advance = (slot->advance.x + 32) >> 6;
+	g->cp = cp;
+	g->ok = 1;
+	return g;
+}
+
+static void
+soft_extents(const char *s, int n, XGlyphInfo *gi) {
+	int pen = 0, x0 = 0, y0 = 0, x1 = 0, y1 = 0, ink = 0;
+	struct glyph *g;
+	uint32_t cp;
+
+	for (int i = 0; i < n; pen += g ? g->advance : 0) {
+		i += utf8_decode(s + i, n - i, &cp);
+		if (!(g = glyph(cp)) || !g->w || !g->h) continue;
+		if (!ink || pen + g->left < x0) x0 = pen + g->left;
+		if (!ink || pen + g->left + g->w > x1) x1 = pen + g->left + g->w;
+		if (!ink || -g->top < y0) y0 = -g->top;
+		if (!ink || g->h - g->top > y1) y1 = g->h - g->top;
+		ink = 1;
+	}
+	/* Same meaning as Xft's: x and y are the origin within the ink box */
+	gi->x = -x0;
+	gi->y = -y0;
+	gi->width = x1 - x0;
+	gi->height = y1 - y0;
+	gi->xOff = pen;
+	gi->yOff = 0;
+}
+
+static void
+soft_clip(Region r) {
+	clip = r;
+}
+
+/* Intersects [*x0, *x1) x [*y0, *y1) with clip rectangle 'i' and 'fb' */
+static int
+clip_box(long i, int *x0, int *y0, int *x1, int *y1) {
+	BOX *b = &clip->rects[i];
+
+	if (*x0 < b->x1) *x0 = b->x1;
+	if (*y0 < b->y1) *y0 = b->y1;
+	if (*x1 > b->x2) *x1 = b->x2;
+	if (*y1 > b->y2) *y1 = b->y2;
+	if (*x0 < 0) *x0 = 0;
+	if (*y0 < 0) *y0 = 0;
+	if (*x1 > fb.w) *x1 = fb.w;
+	if (*y1 > fb.h) *y1 = fb.h;
+	return *x0 < *x1 && *y0 < *y1;
+}
+
+static void
+soft_bg(int o, Region r) {
+	REGION *reg = r;
+
+	for (long i = 0; i < reg->numRects; i++) {
+		BOX *b = &reg->rects[i];
+		int x0 = b->x1, y0 = b->y1, x1 = b->x2, y1 = b->y2;
+
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 > fb.w) x1 = fb.w;
+		if (y1 > fb.h) y1 = fb.h;
+		for (int y = y0; y < y1; y++) {
+			uint32_t *d = fb.data + (size_t)y * fb.w;
+
+			if (!bg_img) {
+				for (int x = x0; x < x1; x++) d[x] = bg_color;
+				continue;
+			}
+			/* Tiled from the output's corner, like the X11 renderer */
+			const uint32_t *s = bg_img->data + (size_t)((y - outputs[o].y) % \
+				bg_img->h) * bg_img->w;
+			int sx = (x0 - outputs[o].x) % bg_img->w;
+
+			for (int x = x0; x < x1;) {
+				int run = bg_img->w - sx < x1 - x ? bg_img->w - sx : x1 - x;
+
+				memcpy(d + x, s + sx, run * 4);
+				x += run;
+				sx = 0;
+			}
+		}
+	}
+}
+
+static uint32_t
+blend(uint32_t d, uint32_t s, unsigned int a) {
+	uint32_t rb = d & 0xff00ff, g = d & 0xff00;
+
+	rb = ((((s & 0xff00ff) - rb) * a >> 8) + rb) & 0xff00ff;
+	g = ((((s & 0xff00) - g) * a >> 8) + g) & 0xff00;
+	return 0xff000000 | rb | g;
+}
+
+static void
+soft_text(int x, int y, const char *s, int n) {
+	struct glyph *g;
+	uint32_t cp;
+
+	for (int i = 0; i < n; x += g ? g->advance : 0) {
+		i += utf8_decode(s + i, n - i, &cp);
+		if (!(g = glyph(cp)) || !g->bits) continue;
+		for (long c = 0; c < clip->numRects; c++) {
+			int gx = x + g->left, gy = y - g->top;
+			int x0 = gx, y0 = gy, x1 = gx + g->w, y1 = gy + g->h;
+
+			if (!clip_box(c, &x0, &y0, &x1, &y1)) continue;
+			for (int py = y0; py < y1; py++) {
+				const unsigned char *a = g->bits + (py - gy) * g->w;
+				uint32_t *d = fb.data + (size_t)py * fb.w;
+
+				for (int px = x0; px < x1; px++) {
+					unsigned int v = a[px - gx];
+
+					if (v) d[px] = blend(d[px], fg_color, v + 1);
+				}
+			}
+		}
+	}
+}
+
+static void
+soft_line(int x1, int x2, int y) {
+	for (long c = 0; c < clip->numRects; c++) {
+		int x0 = x1, y0 = y, xe = x2 + 1, ye = y + 1;
+
+		if (!clip_box(c, &x0, &y0, &xe, &ye)) continue;
+		for (int x = x0; x < xe; x++) fb.data[(size_t)y * fb.w + x] = fg_color;
+	}
+}
+
+static void
+soft_present(const XRectangle *box) {
+}
+
+static int
+soft_atlas(int size) {
+	img_free(&sprites);
+	sprite_size = size;
+	return indicator_atlas(&sprites, size);
+}
+
+static void
+soft_sprite(int f, int x, int y) {
+	for (long c = 0; c < clip->numRects; c++) {
+		int x0 = x, y0 = y, x1 = x + sprite_size, y1 = y + sprite_size;
+
+		if (!clip_box(c, &x0, &y0, &x1, &y1)) continue;
+		for (int py = y0; py < y1; py++) {
+			const uint32_t *s = sprites.data + (size_t)(py - y) * sprites.w + \
+				f * sprite_size - x;
+			uint32_t *d = fb.data + (size_t)py * fb.w;
+
+			for (int px = x0; px < x1; px++) {
+				unsigned int a = s[px] >> 24;
+
+				if (a) d[px] = blend(d[px], s[px], a + 1);
+			}
+		}
+	}
+}
+
+/*
+ * Sets up a 'w' x 'h' framebuffer and the fontconfig font 'fontname'
+ * (XLFD names aren't understood here). NULL if either fails.
+ */
+struct renderer *
+soft_open(int w, int h, const char *fontname) {
+	FcPattern *pat, *match;
+	FcResult res;
+	FcChar8 *file;
+	double size = 12;
+	int index = 0;
+
+	if (w <= 0 || h <= 0 || (size_t)w > SIZE_MAX / 4 / h || \
+		!(fb.data = calloc((size_t)w * h, 4)))
+		return NULL;
+	fb.w = w;
+	fb.h = h;
+
+	if (!FcInit() || !(pat = FcNameParse((const FcChar8 *)fontname)))
+		goto fail;
+	FcConfigSubstitute(NULL, pat, FcMatchPattern);
+	FcDefaultSubstitute(pat);
+	match = FcFontMatch(NULL, pat, &res);
+	FcPatternDestroy(pat);
+	if (!match) goto fail;
+	if (FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch || \
+		FT_Init_FreeType(&ft)) {
+		FcPatternDestroy(match);
+		goto fail;
+	}
+	FcPatternGetInteger(match, FC_INDEX, 0, &index);
+	FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &size);
+	if (FT_New_Face(ft, (const char *)file, index, &face)) {
+		FcPatternDestroy(match);
+		FT_Done_FreeType(ft);
+		goto fail;
+	}
+	FcPatternDestroy(match);
+	FT_Set_Pixel_Sizes(face, 0, size + 0.5);
+
+	soft.ascent = (face->size->metrics.ascender + 63) >> 6;
+	soft.descent = -face->size->metrics.descender >> 6;
+	soft.extents = soft_extents;
+	soft.clip = soft_clip;
+	soft.background = soft_bg;
+	soft.text = soft_text;
+	soft.line = soft_line;
+	soft.present = soft_present;
+	soft.atlas = soft_atlas;
+	soft.sprite = soft_sprite;
+	return &soft;
+
+fail:
+	img_free(&fb);
+	return NULL;
+}
+
+/* The background is 'img' tiled per output, or 'color' if it's NULL */
+void
+soft_background(uint32_t color, const struct image *img) {
+	bg_color = color;
+	bg_img = img;
+}
+
+const struct image *
+soft_framebuffer(void) {
+	return &fb;
+}
+
+void
+soft_close(void) {
+	for (int i = 0; i < GLYPHS; i++) free(glyphs[i].bits);
+	memset(glyphs, 0, sizeof glyphs);
+	img_free(&sprites);
+	FT_Done_Face(face);
+	FT_Done_FreeType(ft);
+	img_free(&fb);
+}
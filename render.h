@@ -0,0 +1,44 @@
+/* See LICENSE file for license details. */
+
+/*
+ * What layout.c paints with. sflock's X11 renderer draws into the back
+ * buffer and copies it to the window; the software one below rasterizes
+ * into a memory framebuffer, so the layout and the paint path can run
+ * without an X server.
+ */
+struct renderer {
+	int ascent, descent;  /* of the font, in pixels */
+	/* Measures the UTF-8 string 's' of 'n' bytes */
+	void (*extents)(const char *s, int n, XGlyphInfo *gi);
+	/* Restricts what follows, up to present(), to 'r' */
+	void (*clip)(Region r);
+	/* Fills the part 'r' of output number 'o' with the background */
+	void (*background)(int o, Region r);
+	/* Draws 'n' bytes of UTF-8 with the baseline starting at (x, y) */
+	void (*text)(int x, int y, const char *s, int n);
+	/* Draws a horizontal line from x1 to x2, both included */
+	void (*line)(int x1, int x2, int y);
+	/* Makes the painted 'box' visible */
+	void (*present)(const XRectangle *box);
+	/* Rasterizes the indicator frames, 'size' pixels square, -1 if it can't */
+	int (*atlas)(int size);
+	/* Draws indicator frame 'f' with its top left corner at (x, y) */
+	void (*sprite)(int f, int x, int y);
+};
+
+/*
+ * Frames of the keystroke indicator: a ring of RINGSEGS segments, one of
+ * them lit by a keystroke or a BackSpace, or all of it showing that the
+ * password is being checked or was wrong. With caps lock on, frame f is
+ * at f + IndLast. indicator_atlas() lays all of them out left to right.
+ */
+#define RINGSEGS 8
+enum { IndIdle, IndVerify, IndWrong, IndKey, IndErase = IndKey + RINGSEGS, \
+	IndLast = IndErase + RINGSEGS };
+
+int indicator_atlas(struct image *atlas, int size);
+
+struct renderer *soft_open(int w, int h, const char *fontname);
+void soft_background(uint32_t color, const struct image *img);
+const struct image *soft_framebuffer(void);
+void soft_close(void);
@@ -2,15 +2,18 @@
 #define _XOPEN_SOURCE 500
 #if HAVE_SHADOW_H
 #include <shadow.h>
+#include <crypt.h>
 #endif
 
 #include <ctype.h>
+#include <dirent.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -18,11 +21,30 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <X11/xpm.h>
 #include <X11/keysym.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/extensions/dpms.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/Xft/Xft.h>
+
+#include "config.h"
+#include "img.h"
+#include "render.h"
+#include "layout.h"
+#include "stats.h"
 
 #if HAVE_BSD_AUTH
 #include <login_cap.h>
@@ -33,46 +55,97 @@ char* wrn_error_bg = \
 	"warning: could not read provided error background image\n";
 
 /* Variable definitions {{{ */
-char* passchar = "*";
-char* fontname = "*-helvetica-bold-r-normal-*-*-120-*-*-*-*-iso8859-1";
+// defaults for all of these are in config.h
+char* passchar = PASSCHAR;
+char* fontname = FONT;
 // char* fontname = "-*-tamzen-medium-*-*-*-17-*-*-*-*-*-*-*";
 char* username;
-// show/hide element variables
-int show_name = 1;
-int show_line = 1;
-int show_password = 1;
-// element variables
-int use_line_length = 0;
-int new_line_length = 100;
-int line_length;
-/* Location variables */
-// -x and -y variables
-int use_x = 0, use_y = 0;
-int new_x = 0, new_y = 0;
-// --name-[xy], --line-[xy], --password-[xy] variables
-int use_name_x = 0, use_name_y = 0;
-int use_line_x = 0, use_line_y = 0;
-int use_password_x = 0, use_password_y = 0;
-int new_name_x = 0, new_name_y = 0;
-int new_line_x = 0, new_line_y = 0;
-int new_password_x = 0, new_password_y = 0;
+// element, location and output variables are in layout.c
 char* name_file;
-char name_file_contents[1000];
+#define NAMEMAX (1 << 20) /* of the name file read, a runaway file is cut */
+#define NAMELINE 1024     /* of a line streamed in, longer ones are cut */
 int use_name_file = 0;
-// --x-shift and --y-shift variables
-int x_shift = 0, y_shift = 0;
+char* name_file_base;
+int name_file_timer;
+int name_file_fd = -1;  /* inotify, -1 if the timer polls instead */
+// --name-cmd, or -N naming a FIFO or Unix socket: lines are streamed in
+char* name_cmd;
+int use_name_stream = 0;
+int name_fd = -1;       /* the stream lines are read from */
+pid_t name_pid = -1;    /* the --name-cmd process */
+char name_line[NAMELINE]; /* line being read */
+int name_line_len = 0;
+int name_stream_timer;  /* reopens the stream after it ended */
+// widget variables (-t, -u, -H, -K)
+#define WIDGETTEXT 128
+#define BATTERYSECS 30    /* how often the battery is read again */
+#define POWER_SUPPLY "/sys/class/power_supply"
+#define OPTPOS 256        /* --<widget>-pos is OPTPOS + the widget's element */
+char* clock_fmt = CLOCK_FMT; /* -t, strftime format of the clock */
+char* date_fmt = DATE_FMT;   /* -u, and of the date */
+char widget_texts[ElLast][WIDGETTEXT];
+char battery_dir[300];  /* the first battery in POWER_SUPPLY, "" if none */
+time_t battery_next;    /* when the battery is read again */
+int widget_timer;
+int widget_period = 60; /* s between widget ticks, 1 if a format shows seconds */
+// keystroke indicator (-g) variables
+int ind_state = IndIdle; /* IndIdle, IndKey or IndErase, or IndWrong */
+int ind_keys = 0;       /* keystrokes so far, picks the segment lit */
+int caps_lock = 0;
 // image variables
 int use_b_image = 0;
-char* b_image_loc = "";
+char* b_image_loc = BG_IMAGE;
 int use_e_b_image = 0;
-char* e_b_image_loc = "";
-Pixmap p;
-Pixmap bg;
+char* e_b_image_loc = ERROR_IMAGE;
+int error_duration = ERROR_TIME;
+int error_timer;
+int image_mode = IMAGE_MODE;
+int blur_radius = BLUR_RADIUS; /* -b, blur a screenshot for the background */
+int pixel_size = PIXEL_SIZE;   /* -k, pixelate a screenshot for the background */
+int use_shot = 0;       /* either of them */
+/* password verification vars */
+char* verify_text = "verifying...";
+int verifying = 0;      /* auth_thread is checking a password right now */
+int auth_pipe[2];       /* auth_thread writes its verdict here */
+char auth_passwd[256];  /* the password auth_thread is checking */
+#ifdef STATS
+long long auth_started; /* when start_auth() ran, for the auth stage */
+#endif
+/* lock readiness vars */
+#define GRABTIMEOUT 1000  /* ms to keep retrying the input grabs */
+#define GRABMAXWAIT 64    /* ms, longest wait between two grab attempts */
+int ready_fd = -1;      /* -R: where "locked <ms>" is written once locked */
+int ready_pipe[2];      /* the locked child tells the forked parent here */
+long long start_ms;     /* when sflock started, for the time to lock */
+int typed = 0;          /* the password changed in this batch of events */
+/* power vars */
+enum { PowerActive, PowerDimmed, PowerOff };
+int power = PowerActive;
+int idle_time = IDLE_TIME; /* -I, seconds without input before dimming */
+int idle_timer;
+BOOL dpms_was_enabled;  /* DPMS state to go back to once active again */
+BOOL dpms_capable;      /* the display can be dimmed and switched off */
+Display *blank_dpy;     /* Escape is held down on it, blank once it's up */
+KeyCode blank_key;
+/* daemon (-d) vars */
+#define MAXCLIENTS 4      /* lock requests waiting for their answer */
+int daemon_mode = 0;
+int locked = 0;         /* the screen is covered and the input grabbed */
+char* socket_path;      /* -S, where lock and status requests come in */
+int lock_sigpipe[2];    /* SIGUSR2 -> main loop */
+int waiters[MAXCLIENTS];
+int nwaiters = 0;
 /* main vars */
 
 char curs[] = {0, 0, 0, 0, 0, 0, 0, 0};
-char buf[32], passwd[256], passdisp[256];
-int num, screen, width, height, update, sleepmode, term, pid;
+char buf[32], passwd[256];
+/*
+ * passdisp holds one (possibly multibyte UTF-8) password character per
+ * byte of passwd. passdisp_off[n] is the byte length of the first n.
+ */
+char passdisp[256 * 4];
+int passdisp_off[256 + 1];
+int num, screen, term, pid;
 
 #ifndef HAVE_BSD_AUTH
     const char *pws;
@@ -81,22 +154,110 @@ int num, screen, width, height, update, sleepmode, term, pid;
     Bool running = True;
     Cursor invisible;
     Display *dpy;
+    xcb_connection_t *xc; /* dpy's XCB side, for requests sent as a batch */
     KeySym ksym;
     Pixmap pmap;
     Window root, w;
-    XColor black, red, dummy;
+    XColor bgcolor, red; /* BG_COLOR and ERROR_COLOR from config.h */
     XEvent ev;
     XSetWindowAttributes wa;
-    XFontStruct* font;
+    XftFont* font;
+    XftDraw* xftdraw;
+    XftColor fgcolor;
     GC gc;
     XGCValues values;
-/* update_screen vars */
-
-int x, y, mid_y, dir, ascent, descent;
-XCharStruct overall;
+/* output (monitor) vars */
+int use_randr, rr_event_base, rr_error_base;
+/*
+ * Both images are fitted to every output size at startup, straight from
+ * the disk cache when it has them. Only a cache miss decodes the file;
+ * the decoded image is then kept so outputs that show up later can get
+ * their own scaled copy. The scaled copies live on the server, one per
+ * distinct output size, and outputs of the same size share one.
+ */
+struct background {
+	char *path;
+	int ok;           /* 0 if the file couldn't be read, use a color */
+	int shot;         /* a screenshot: scaled[o] is output o's part of it */
+	struct image *img; /* decoded on the first cache miss, for all screens */
+	int nscaled;
+	struct {
+		int w, h;
+		Pixmap pm;
+	} scaled[MAXOUTPUTS];
+};
+struct background normal_bg, error_bg;
+struct image normal_img, error_img;
+struct background *cur_bg; /* NULL means a solid cur_pixel background */
+unsigned long cur_pixel;
+/* event loop vars */
+#define MAXWATCHES 16
+#define MAXTIMERS 8
+struct watch {
+	int fd;
+	void (*handler)(int fd);
+};
+struct timer {
+	int armed;
+	long long when; /* CLOCK_MONOTONIC deadline in milliseconds */
+	void (*handler)(void);
+};
+struct watch watches[MAXWATCHES];
+int nwatches = 0;
+struct timer timers[MAXTIMERS];
+int ntimers = 0;
+/* X11 renderer vars */
+Pixmap backbuf; /* off-screen copy of the window everything is drawn into */
+GC bggc;        /* fills the back buffer with the current background */
+Picture atlas_pic = None; /* the indicator frames, side by side */
+int sprite_size;
+/* multiple screen (-s) vars */
+#define MAXLOCKS 8
+/*
+ * One per locked screen. The X globals above always belong to one of
+ * them, use_lock() saves them into their lock and loads another's (the
+ * layout along with them). dpy, screen, root and w never change once a
+ * lock is set up, so those can be read from any lock.
+ */
+struct lock {
+	Display *dpy;
+	xcb_connection_t *xc;
+	int screen;
+	Window root, w;
+	Pixmap pmap, backbuf;
+	Cursor invisible;
+	XColor bgcolor, red;
+	XftFont *font;
+	XftDraw *xftdraw;
+	XftColor fgcolor;
+	GC gc, bggc;
+	Picture atlas_pic;
+	int sprite_size;
+	int use_randr, rr_event_base, rr_error_base;
+	BOOL dpms_was_enabled, dpms_capable;
+	struct background normal_bg, error_bg, *cur_bg;
+	unsigned long cur_pixel;
+	struct renderer x11_renderer;
+	struct layout *layout;
+};
+struct lock locks[MAXLOCKS];
+int nlocks = 0;
+int cur_lock = -1;
+char* display_names[MAXLOCKS]; /* -s, NULL for $DISPLAY */
+int ndisplay_names = 0;
+int display_locks[MAXLOCKS]; /* the first lock on every display */
+int ndisplays = 0;
 
 /* End of Variable definitions }}} */
 
+/* function declarations */
+void draw_error_bg(void);
+void unlock_screen(void);
+void free_background(struct background *b);
+void use_lock(int i);
+void relayout_locks(int el);
+void set_names(const char *s, int n);
+
 
 static void
 die(const char *errstr, ...) {
@@ -108,12 +269,152 @@ die(const char *errstr, ...) {
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Returns the byte length of the UTF-8 character starting at 's'. Stray
+ * continuation bytes and the terminating '\0' count as one byte.
+ */
+int utf8_len(const char *s) {
+	unsigned char c = *s;
+	int n = 1;
+
+	if (c >= 0xf0) n = 4;
+	else if (c >= 0xe0) n = 3;
+	else if (c >= 0xc0) n = 2;
+	for (int i = 1; i < n; i++)
+		if ((s[i] & 0xc0) != 0x80) return 1;
+	return n;
+}
+
+/* Cuts off a UTF-8 character left incomplete at the end of 's' ('n' bytes) */
+void utf8_trim(char *s, int n) {
+	int k = n;
+
+	while (k > 0 && (s[k - 1] & 0xc0) == 0x80) k--;
+	if (k > 0 && utf8_len(s + k - 1) != n - k + 1)
+		s[k - 1] = '\0';
+}
+
+/* Event loop helpers (fd watches and timers) {{{ */
+long long now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Registers 'fd' with the main loop. Whenever poll() reports the fd as
+ * readable (or hung up), 'handler' is called with it.
+ */
+void add_watch(int fd, void (*handler)(int fd)) {
+	if (nwatches >= MAXWATCHES)
+		die("sflock: too many fd watches\n");
+	watches[nwatches].fd = fd;
+	watches[nwatches].handler = handler;
+	nwatches++;
+}
+
+void remove_watch(int fd) {
+	for (int i = 0; i < nwatches; i++) {
+		if (watches[i].fd == fd) {
+			watches[i] = watches[--nwatches];
+			return;
+		}
+	}
+}
+
+/*
+ * Returns a timer id that can be passed to arm_timer() and disarm_timer().
+ * 'handler' is run from the main loop once the armed timer expires.
+ */
+int add_timer(void (*handler)(void)) {
+	if (ntimers >= MAXTIMERS)
+		die("sflock: too many timers\n");
+	timers[ntimers].armed = 0;
+	timers[ntimers].handler = handler;
+	return ntimers++;
+}
+
+void arm_timer(int id, long long ms) {
+	timers[id].armed = 1;
+	timers[id].when = now_ms() + ms;
+}
+
+void disarm_timer(int id) {
+	timers[id].armed = 0;
+}
+
+/* Milliseconds until the next armed timer expires, -1 if none are armed */
+int next_timeout(void) {
+	long long next = -1, now = now_ms();
+
+	for (int i = 0; i < ntimers; i++) {
+		if (!timers[i].armed) continue;
+		if (timers[i].when <= now) return 0;
+		if (next == -1 || timers[i].when - now < next)
+			next = timers[i].when - now;
+	}
+	return (int)next;
+}
+
+void run_timers(void) {
+	long long now = now_ms();
+
+	for (int i = 0; i < ntimers; i++) {
+		if (timers[i].armed && timers[i].when <= now) {
+			timers[i].armed = 0;
+			timers[i].handler();
+		}
+	}
+}
+
+/*
+ * Blocks until one of the X connections or one of the watched fds
+ * becomes readable, or until the next timer is due. Nothing here polls;
+ * an idle lock screen stays asleep in poll().
+ */
+void wait_for_events(void) {
+	struct pollfd pfds[MAXLOCKS + MAXWATCHES];
+	int n = 0;
+
+	for (int d = 0; d < ndisplays; d++) {
+		pfds[n].fd = ConnectionNumber(locks[display_locks[d]].dpy);
+		pfds[n++].events = POLLIN;
+	}
+	for (int i = 0; i < nwatches; i++) {
+		pfds[n].fd = watches[i].fd;
+		pfds[n++].events = POLLIN;
+	}
+
+	if (poll(pfds, n, next_timeout()) == -1) {
+		if (errno == EINTR) return;
+		die("sflock: poll failed: %s\n", strerror(errno));
+	}
+	STAT_COUNT(CtWakeup);
+
+	/* Walk backwards so a handler may remove its own watch */
+	for (int i = n - 1; i >= ndisplays; i--) {
+		if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			watches[i - ndisplays].handler(pfds[i].fd);
+	}
+}
+/* }}} */
+
 #ifndef HAVE_BSD_AUTH
 static const char *
 get_password() { /* only run as root */
     const char *rval;
     struct passwd *pw;
 
+#ifdef BENCH
+	/*
+	 * Benchmark builds (make bench) check against a hash from the
+	 * harness, they never need root or read the real password database.
+	 */
+	if (!(rval = getenv("SFLOCK_BENCH_HASH")))
+		die("sflock: SFLOCK_BENCH_HASH is not set\n");
+	return rval;
+#endif
 	if(geteuid() != 0)
 		die("sflock: cannot retrieve password entry " \
 			"(make sure to suid sflock)\n");
@@ -137,34 +438,504 @@ get_password() { /* only run as root */
 }
 #endif
 
+/*
+ * Picks up the answer to an xcb_alloc_named_color() sent earlier. A name
+ * the server doesn't know leaves the color black, as it always did.
+ */
+void named_color(xcb_alloc_named_color_cookie_t c, XColor *color) {
+	xcb_alloc_named_color_reply_t *r;
+
+	memset(color, 0, sizeof *color);
+	color->pixel = XBlackPixel(dpy, screen);
+	if ((r = xcb_alloc_named_color_reply(xc, c, NULL))) {
+		color->pixel = r->pixel;
+		color->red = r->visual_red;
+		color->green = r->visual_green;
+		color->blue = r->visual_blue;
+		free(r);
+	}
+	color->flags = DoRed | DoGreen | DoBlue;
+}
+
+/* Input grab and readiness helpers {{{ */
+const char* grab_error(int status) {
+	switch (status) {
+		case AlreadyGrabbed: return "another client has it grabbed";
+		case GrabInvalidTime: return "invalid time";
+		case GrabNotViewable: return "window not viewable";
+		case GrabFrozen: return "frozen by another client's grab";
+	}
+	return "unknown error";
+}
+
+/*
+ * Grabs the keyboard and the pointer. Every round sends a request for
+ * each grab not held yet and only then waits for the answers, so a round
+ * costs one round trip however many grabs it asks for, and one that's
+ * free is taken right away even while the other is busy. Between rounds
+ * the wait doubles from 1 ms up to GRABMAXWAIT ms. After GRABTIMEOUT ms
+ * it gives up, says which grab failed and returns 0, leaving main() to
+ * unlock the console again.
+ */
+int grab_input(void) {
+	int kbd = AlreadyGrabbed, ptr = AlreadyGrabbed;
+	long long deadline = now_ms() + GRABTIMEOUT;
+	xcb_grab_keyboard_cookie_t kc;
+	xcb_grab_pointer_cookie_t pc;
+	xcb_grab_keyboard_reply_t *kr;
+	xcb_grab_pointer_reply_t *pr;
+
+	for (int wait = 1;; wait = wait * 2 > GRABMAXWAIT ? GRABMAXWAIT : wait * 2) {
+		if (kbd != GrabSuccess)
+			kc = xcb_grab_keyboard(xc, 1, root, XCB_CURRENT_TIME, \
+				XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+		if (ptr != GrabSuccess)
+			pc = xcb_grab_pointer(xc, 0, root, XCB_EVENT_MASK_BUTTON_PRESS | \
+				XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION, \
+				XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, \
+				invisible, XCB_CURRENT_TIME);
+		STAT_COUNT(CtRoundTrip);
+		/* A request that failed outright has no status, it's "unknown" */
+		if (kbd != GrabSuccess) {
+			kr = xcb_grab_keyboard_reply(xc, kc, NULL);
+			kbd = kr ? kr->status : -1;
+			free(kr);
+		}
+		if (ptr != GrabSuccess) {
+			pr = xcb_grab_pointer_reply(xc, pc, NULL);
+			ptr = pr ? pr->status : -1;
+			free(pr);
+		}
+		if (kbd == GrabSuccess && ptr == GrabSuccess) return 1;
+		if (now_ms() >= deadline) break;
+		usleep(wait * 1000);
+	}
+	if (kbd != GrabSuccess)
+		fprintf(stderr, "sflock: cannot grab keyboard: %s\n", grab_error(kbd));
+	if (ptr != GrabSuccess)
+		fprintf(stderr, "sflock: cannot grab pointer: %s\n", grab_error(ptr));
+	return 0;
+}
+
+/*
+ * Run by the parent after forking. It only exits once the child has
+ * locked the screen (status 0, "locked <ms>" written to the -R fd) or
+ * died trying (status 1), so "sflock && suspend" can't suspend unlocked.
+ */
+void wait_ready(void) {
+	long long ms;
+	char line[32];
+	ssize_t n;
+
+	close(ready_pipe[1]);
+	while ((n = read(ready_pipe[0], &ms, sizeof ms)) == -1 && errno == EINTR);
+	if (n != sizeof ms) exit(EXIT_FAILURE);
+	if (ready_fd != -1) {
+		n = snprintf(line, sizeof line, "%s %lld\n", \
+			daemon_mode ? "armed" : "locked", ms);
+		if (write(ready_fd, line, n) != n) perror("error writing ready fd");
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Called by the child once the window is up and both grabs are held, or
+ * in daemon mode once it's ready to take lock requests.
+ */
+void notify_ready(void) {
+	long long ms = now_ms() - start_ms;
+
+	if (write(ready_pipe[1], &ms, sizeof ms) != sizeof ms)
+		perror("error notifying parent");
+	close(ready_pipe[1]);
+}
+/* }}} */
+
+/* Password verification helpers {{{ */
+void wipe(volatile char *s, size_t n) {
+	while (n--) *s++ = 0;
+}
+
+/*
+ * Checks auth_passwd away from the main thread, so the lock screen keeps
+ * handling events and drawing while a slow hash (yescrypt, SHA-512 with
+ * many rounds) is computed. The verdict goes to auth_pipe as one byte,
+ * which wakes up the main loop.
+ */
+void* auth_thread(void *arg) {
+	char ok;
+#ifdef HAVE_BSD_AUTH
+	ok = auth_userokay(getlogin(), NULL, "auth-xlock", auth_passwd) != 0;
+#else
+	const char *hash = crypt(auth_passwd, pws);
+
+	ok = hash && strcmp(hash, pws) == 0;
+#endif
+	wipe(auth_passwd, sizeof auth_passwd);
+	if (write(auth_pipe[1], &ok, 1) != 1)
+		die("sflock: cannot report password check\n");
+	return NULL;
+}
+
+/* Hands the typed password to auth_thread and shows "verifying" */
+void start_auth(void) {
+	pthread_t tid;
+
+	memcpy(auth_passwd, passwd, len);
+	auth_passwd[len] = '\0';
+	wipe(passwd, sizeof passwd);
+	verifying = 1;
+#ifdef STATS
+	auth_started = stats_now();
+#endif
+	if (pthread_create(&tid, NULL, auth_thread, NULL) == 0)
+		pthread_detach(tid);
+	else
+		auth_thread(NULL);
+}
+
+/* Called by the main loop once auth_thread has written its verdict */
+void auth_done(int fd) {
+	char ok;
+
+	if (read(fd, &ok, 1) != 1) return;
+	STAT_END(StAuth, auth_started);
+	verifying = 0;
+	running = !ok || daemon_mode;
+	DEBUG("running after checking pass %d\n", running);
+	// If the password the user entered was incorrect
+	if (!ok) {
+		draw_error_bg();
+		ind_state = IndWrong;
+	}
+	// A daemon goes back to waiting for the next lock request
+	else if (daemon_mode) unlock_screen();
+	relayout_locks(ElPassword);
+	relayout_locks(ElIndicator);
+}
+/* }}} */
+
+/*
+ * Reads the name file and shows it, newlines and all, in the name panel,
+ * which repaints whatever lines changed. If the file could not be opened
+ * the old contents are kept.
+ */
 void read_file(void) {
-	/*
-	 * Open file in read only mode, if the file exists, loop through all
-	 * the chars in the file. If the current char is NOT a newline char, add it
-	 * to the char array. New lines aren't drawn by the XDraw function used
-	 * to draw the username text.
-	 */
-	int c;
+	static char *contents;
+	static size_t size;
+	size_t n = 0, r;
 	FILE *file;
+	STAT_COUNT(CtNameRead);
 	file = fopen(name_file, "r");
 	if (file) {
-		int j = 0;
-		while (((c = getc(file)) != EOF) && (j < sizeof(name_file_contents))) {
-			if (c != '\n') {
-				name_file_contents[j] = c;
-				j += 1;
+		/* Grow the buffer until the whole file fits, up to NAMEMAX */
+		for (;;) {
+			if (n == size) {
+				char *p = size < NAMEMAX ? realloc(contents, size ? \
+					size * 2 + 1 : 1025) : NULL;
+
+				if (!p) break;
+				contents = p;
+				size = size ? size * 2 : 1024;
 			}
+			if ((r = fread(contents + n, 1, size - n, file)) == 0) break;
+			n += r;
+		}
+		/* Don't leave half a UTF-8 character at the end if we truncated */
+		if (!feof(file) && n) {
+			contents[n] = '\0';
+			utf8_trim(contents, n);
+			n = strlen(contents);
 		}
-		/* Unnecessary on first read, but necessary when "refilling"  array */
-		name_file_contents[j] = '\0';
 		fclose(file);
+		set_names(contents, n);
+	}
+}
+
+/* Called by the main loop when the name file's directory reports events */
+void name_file_changed(int fd) {
+	char evbuf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	int hit = 0;
+	ssize_t n;
+
+	while ((n = read(fd, evbuf, sizeof evbuf)) > 0) {
+		for (char *e = evbuf; e < evbuf + n; e += sizeof *ie + ie->len) {
+			ie = (struct inotify_event *)e;
+			if (ie->len && strcmp(ie->name, name_file_base) == 0) hit = 1;
+		}
+	}
+	if (hit) read_file();
+}
+
+/* Fallback for when inotify is unavailable: check the file once a second */
+void name_file_tick(void) {
+	read_file();
+	arm_timer(name_file_timer, 1000);
+}
+
+/*
+ * Watches the directory containing the name file rather than the file
+ * itself so that scripts which write a temp file and rename() it over
+ * the name file are picked up too.
+ */
+void watch_name_file(void) {
+	static char dirbuf[4096], basebuf[4096];
+	int fd;
+
+	snprintf(dirbuf, sizeof dirbuf, "%s", name_file);
+	snprintf(basebuf, sizeof basebuf, "%s", name_file);
+	name_file_base = basename(basebuf);
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd != -1 && inotify_add_watch(fd, dirname(dirbuf), IN_MODIFY | \
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) != -1) {
+		add_watch(fd, name_file_changed);
+		name_file_fd = fd;
+		return;
+	}
+
+	printf("warning: could not watch name file, checking it every second\n");
+	if (fd != -1) close(fd);
+	name_file_timer = add_timer(name_file_tick);
+	arm_timer(name_file_timer, 1000);
+}
+
+/*
+ * Name streams. Instead of a file that is read again whenever it changes,
+ * the name can come from the output of --name-cmd, or from a FIFO or Unix
+ * socket given to -N. Every complete line replaces the name. The stream
+ * is read without blocking from the main loop; when it ends (the command
+ * died, the socket closed) it is reopened a second later.
+ */
+int is_stream(const char *path) {
+	struct stat st;
+
+	return stat(path, &st) == 0 && (S_ISFIFO(st.st_mode) || \
+		S_ISSOCK(st.st_mode));
+}
+
+/* Runs --name-cmd with its output going to a pipe, returns the read end */
+int spawn_name_cmd(void) {
+	int fds[2];
+
+	if (pipe(fds) == -1) return -1;
+	if ((name_pid = fork()) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (name_pid == 0) {
+		uid_t uid = geteuid();
+		int devnull = open("/dev/null", O_RDONLY);
+
+		/* Run as the user for good, get_password() only swapped uids */
+		if (setreuid(uid, uid) == -1) _exit(127);
+		dup2(fds[1], STDOUT_FILENO);
+		if (devnull != -1) dup2(devnull, STDIN_FILENO);
+		/* Don't hand the console or the X connection to the command */
+		for (int fd = 3; fd < 1024; fd++) close(fd);
+		execl("/bin/sh", "sh", "-c", name_cmd, (char *)NULL);
+		_exit(127);
 	}
+	close(fds[1]);
+	return fds[0];
 }
 
+/* Connects to the Unix socket at 'path', returns the socket */
+int connect_name_socket(const char *path) {
+	struct sockaddr_un sa;
+	int fd;
+
+	if (strlen(path) >= sizeof sa.sun_path) return -1;
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void close_name_stream(void) {
+	if (name_fd != -1) {
+		remove_watch(name_fd);
+		close(name_fd);
+		name_fd = -1;
+	}
+	/* SIGKILL, so reaping it right away can't hang the lock */
+	if (name_pid > 0) {
+		kill(name_pid, SIGKILL);
+		waitpid(name_pid, NULL, 0);
+		name_pid = -1;
+	}
+	name_line_len = 0;
+}
+
+void name_stream_read(int fd) {
+	char buf[512];
+	char last[NAMELINE];
+	int got = 0;
+	ssize_t n = 0;
+
+	/* Read a bounded amount, a chatty stream can't keep the loop busy */
+	for (int i = 0; i < 8 && (n = read(fd, buf, sizeof buf)) > 0; i++) {
+		for (int j = 0; j < n; j++) {
+			if (buf[j] != '\n') {
+				if (name_line_len < sizeof(name_line) - 1)
+					name_line[name_line_len++] = buf[j];
+				continue;
+			}
+			name_line[name_line_len] = '\0';
+			utf8_trim(name_line, name_line_len);
+			name_line_len = 0;
+			strcpy(last, name_line);
+			got = 1;
+		}
+	}
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		close_name_stream();
+		arm_timer(name_stream_timer, 1000);
+	}
+	/* Only the last complete line counts, it's repainted if it differs */
+	if (got) set_names(last, strlen(last));
+}
+
+void open_name_stream(void) {
+	struct stat st;
+
+	if (name_cmd) name_fd = spawn_name_cmd();
+	else if (stat(name_file, &st) == 0 && S_ISSOCK(st.st_mode))
+		name_fd = connect_name_socket(name_file);
+	/* Opened for writing too, so the FIFO never reports end of file */
+	else name_fd = open(name_file, O_RDWR | O_NONBLOCK);
+
+	if (name_fd == -1) {
+		arm_timer(name_stream_timer, 1000);
+		return;
+	}
+	fcntl(name_fd, F_SETFL, O_NONBLOCK);
+	fcntl(name_fd, F_SETFD, FD_CLOEXEC);
+	/* With the display off it's watched once it comes back on */
+	if (power != PowerOff) add_watch(name_fd, name_stream_read);
+}
+
+/* Widget helpers {{{ */
+char* widget_text(int el) {
+	return widget_texts[el];
+}
+
+/* Shows 'text' in widget 'el', which is only repainted if it changed */
+void set_widget(int el, const char *text) {
+	if (!*elements[el].show || strcmp(widget_texts[el], text) == 0) return;
+	snprintf(widget_texts[el], WIDGETTEXT, "%s", text);
+	utf8_trim(widget_texts[el], strlen(widget_texts[el]));
+	relayout_locks(el);
+}
+
+/* Whether the strftime format 'fmt' changes from one second to the next */
+int shows_seconds(const char *fmt) {
+	struct tm tm = { .tm_mday = 1, .tm_year = 100 };
+	char a[WIDGETTEXT], b[WIDGETTEXT];
+
+	if (!strftime(a, sizeof a, fmt, &tm)) a[0] = '\0';
+	tm.tm_sec = 1;
+	if (!strftime(b, sizeof b, fmt, &tm)) b[0] = '\0';
+	return strcmp(a, b) != 0;
+}
+
+/* Reads the sysfs attribute 'name' of 'dir' into 'buf', minus the newline */
+int read_attr(const char *dir, const char *name, char *buf, size_t size) {
+	char path[sizeof battery_dir + 32];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	if ((fd = open(path, O_RDONLY)) == -1) return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0) return -1;
+	while (n > 0 && buf[n - 1] == '\n') n--;
+	buf[n] = '\0';
+	return 0;
+}
+
+void find_battery(void) {
+	char dir[sizeof battery_dir], type[32];
+	struct dirent *e;
+	DIR *d;
+
+	if (!(d = opendir(POWER_SUPPLY))) return;
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.') continue;
+		snprintf(dir, sizeof dir, POWER_SUPPLY "/%s", e->d_name);
+		if (read_attr(dir, "type", type, sizeof type) == 0 && \
+			strcmp(type, "Battery") == 0) {
+			strcpy(battery_dir, dir);
+			break;
+		}
+	}
+	closedir(d);
+}
+
+/* "battery 85%, discharging", or nothing without a battery */
+void read_battery(void) {
+	char capacity[16], status[32], text[WIDGETTEXT];
+
+	if (!battery_dir[0] || \
+		read_attr(battery_dir, "capacity", capacity, sizeof capacity) == -1) {
+		set_widget(ElBattery, "");
+		return;
+	}
+	if (read_attr(battery_dir, "status", status, sizeof status) == -1 || \
+		strcmp(status, "Unknown") == 0)
+		status[0] = '\0';
+	status[0] = tolower((unsigned char)status[0]);
+	snprintf(text, sizeof text, "battery %s%%%s%s", capacity, \
+		status[0] ? ", " : "", status);
+	set_widget(ElBattery, text);
+}
+
+/*
+ * Updates the clock, the date and every BATTERYSECS the battery, then
+ * sleeps until the next whole second (or minute, or BATTERYSECS with the
+ * battery shown, if no format shows seconds) on the wall clock. That's
+ * the only wakeup the widgets cost, and only the ones whose text changed
+ * are repainted.
+ */
+void widget_tick(void) {
+	struct timespec ts;
+	struct tm tm;
+	char text[WIDGETTEXT];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
+	if (show_clock) {
+		if (!strftime(text, sizeof text, clock_fmt, &tm)) text[0] = '\0';
+		set_widget(ElClock, text);
+	}
+	if (show_date) {
+		if (!strftime(text, sizeof text, date_fmt, &tm)) text[0] = '\0';
+		set_widget(ElDate, text);
+	}
+	if (show_battery && ts.tv_sec >= battery_next) {
+		read_battery();
+		battery_next = ts.tv_sec + BATTERYSECS;
+	}
+	if (show_clock || show_date || show_battery)
+		arm_timer(widget_timer, widget_period * 1000LL - \
+			ts.tv_sec % widget_period * 1000LL - ts.tv_nsec / 1000000);
+}
+/* }}} */
+
 void print_help(void) {
-	// c:f:nlpoL:hvx:y:X:Y:A:B:C:D:E:F:N:i:e:
+	// c:f:nlpoL:hvx:y:X:Y:A:B:C:D:E:F:N:P:t:u:HKg:i:e:T:I:M:b:k:R:dS:s:
 	printf("sflock\n\tusage: " \
-		"[ -c | -f | -n | -l | -p | -o | -L | -h | -v | -x | -y | -X | -Y | -A | -B | -C | -D | -E | -F | -N | -i | -e | -s | -a ]");
+		"[ -c | -f | -n | -l | -p | -o | -L | -h | -v | -x | -y | -X | -Y | -A | -B | -C | -D | -E | -F | -N | -P | -t | -u | -H | -K | -g | -i | -e | -T | -I | -M | -b | -k | -R | -d | -S | -s | -a ]");
 
 	printf("\n\n\t-c, --password-char passchars\n\t\tTakes a string parameter. " \
 		"The provided string/char will be used to represent the characters " \
@@ -182,9 +953,10 @@ void print_help(void) {
 		"confuse anyone looking over your shoulder.");
 
 	printf("\n\n\t-f, --font-name fontname\n\t\tTakes one string parameter that " \
-		"represents the font you want to use. Uses X Logical Font " \
-		"Description. I'll try to add XFT support at a later date cause " \
-		"XLFD can be a pain.");
+		"represents the font you want to use. Takes an Xft/fontconfig " \
+		"pattern like 'DejaVu Sans:size=14', so any TrueType font works " \
+		"and text is antialiased. X Logical Font Descriptions (starting " \
+		"with '-' or '*') are still accepted.");
 
 	printf("\n\n\t-n, --hide-name\n\t\tsflock will not show the username field " \
 		"at the lock screen. Good if your username is something stupid ;)");
@@ -225,6 +997,10 @@ void print_help(void) {
 		"to make it easier to set the coordinates of the fields if you " \
 		"want two of them to be the same.");
 
+	printf("\n\n\tAll coordinates are relative to the top left corner of the " \
+		"monitor the prompt is on: the primary monitor, or the one the " \
+		"pointer is on if there is no primary.");
+
 	printf("\n\n\t-X, --x-shift horizontal_shift\n\t\tTakes one int parameter. " \
 		"Shifts the username, line and password field x pixels to " \
 		"the right (from the x value which is centered by default).");
@@ -260,19 +1036,61 @@ void print_help(void) {
 	printf("\n\n\t-N, --name-file file_path\n\t\tTakes one string parameter " \
 		"in the format of a file path. Reads the contents of the file and " \
 		"outputs it to the username field. The idea behind this is you can " \
-		"write anything to the file and sflock will read it and display it " \
-		"(except \\n. Maybe I'll add that functionality in the future). " \
-		"One idea would be to make a bash script that prints $(date) to a " \
-		"file every second or so and then your lock screen will show the " \
-		"date. Obviously you can do much more advanced things with this " \
-		"cough cough take a look at your lemonbar scripts.");
+		"write anything to the file and sflock will read it and display it, " \
+		"one line of the file per line on the screen, with lines too wide " \
+		"for the screen wrapped. The file is read again whenever it " \
+		"changes and only the lines that differ are redrawn. If the path " \
+		"is a FIFO or a Unix socket, sflock reads lines from it instead and " \
+		"every complete line replaces the name, so a script can simply " \
+		"keep writing to it (see -P).");
+
+	printf("\n\n\t-P, --name-cmd command\n\t\tTakes one string parameter, " \
+		"a shell command. The command is run as you and every line it " \
+		"prints replaces the contents of the username field, the screen " \
+		"only being redrawn when the line is different. If the command " \
+		"exits it is started again a second later. For example " \
+		"-P 'while date; do sleep 1; done' shows a clock, and so can " \
+		"your lemonbar scripts. Takes precedence over -N.");
+
+	printf("\n\n\t-t, --clock format\n\t\tTakes one string parameter, a " \
+		"strftime format such as '%%H:%%M'. Shows a clock below the " \
+		"password field. It is repainted on its own once a minute, or once " \
+		"a second if the format shows seconds, right as the time changes.");
+
+	printf("\n\n\t-u, --date format\n\t\tTakes one string parameter, a " \
+		"strftime format such as '%%A %%d %%B'. Like --clock, a second " \
+		"line for the date.");
+
+	printf("\n\n\t-H, --hostname\n\t\tShows the host name below the " \
+		"password field.");
+
+	printf("\n\n\t-K, --battery\n\t\tShows the charge and state of the " \
+		"first battery in " POWER_SUPPLY ", read again every %d " \
+		"seconds.", BATTERYSECS);
+
+	printf("\n\n\t-g, --indicator size\n\t\tTakes one int parameter, " \
+		"16 to 400. Shows a ring of size x size pixels above the name " \
+		"that lights a segment for every key typed (orange red for " \
+		"BackSpace), turns blue while the password is checked and orange " \
+		"red when it was wrong, and is filled orange while caps lock is " \
+		"on. All its frames are drawn once at startup, a keystroke only " \
+		"copies one of them to the screen.");
+
+	printf("\n\n\t--clock-pos, --date-pos, --hostname-pos, --battery-pos, " \
+		"--indicator-pos x,y\n\t\tTake two int parameters. Place that " \
+		"widget (the indicator's top left corner) at x,y on the monitor " \
+		"the prompt is on, like --name-x and --name-y do for the name. By " \
+		"default the widgets are centered and stacked below the password " \
+		"field in the order above.");
 
 	printf("\n\n\t-i, --background-image file_path\n\t\tTakes one string " \
 		"parameter in the format of a file path. If the file path leads " \
-		"to an xpm file, the file will be read and the background of " \
-		"the lock screen will be that image. If the image size is smaller " \
-		"than your screen size, the image will be tiled. I plan on adding " \
-		"for other file types in the future.");
+		"to a png, jpeg, farbfeld or xpm file, the file will be read and " \
+		"the background of the lock screen will be that image. By default " \
+		"the image is tiled on every monitor, see -M for other options. " \
+		"The image, fitted to each monitor, is cached in " \
+		"$XDG_CACHE_HOME/sflock (or ~/.cache/sflock) so later runs don't " \
+		"have to decode it again until the file changes.");
 
 	printf("\n\n\t-e, --error-image file_path\n\t\tTakes one string " \
 		"parameter in the format of a file path. If the file path leads " \
@@ -280,162 +1098,1035 @@ void print_help(void) {
 		"password incorrectly, this image will become the background. " \
 		"Useful for telling if someone tried to login to your system when " \
 		"you were away, or, idk. Telling yourself you're bad every time " \
-		"you mess up your password. If the image size is smaller than your " \
-		"screen size, the image will be tiled. I plan on adding for other " \
-		"file types in the future." \
+		"you mess up your password. Takes the same file types as -i and " \
+		"is fitted to the screen the same way." \
 		);
 
+	printf("\n\n\t-I, --idle-time seconds\n\t\tTakes one int parameter. " \
+		"After this many seconds without a key press or mouse movement " \
+		"the display is dimmed (DPMS standby), and after as long again it " \
+		"is switched off. Any input brings it back. Letting go of Escape " \
+		"switches it off, with or without this option. Not set (or 0), the " \
+		"display stays on.");
+
+	printf("\n\n\t-M, --image-mode mode\n\t\tTakes one string parameter, " \
+		"one of 'tile', 'center', 'fit', 'fill' or 'stretch'. Sets how the " \
+		"-i and -e images are fitted to each monitor: repeated from the " \
+		"top left corner (the default), centered without scaling, scaled " \
+		"to fit inside the monitor, scaled to cover the whole monitor " \
+		"(cropping the edges) or stretched to the monitor's size.");
+
+	printf("\n\n\t-T, --error-time milliseconds\n\t\tTakes one int " \
+		"parameter. After a wrong password, the error background " \
+		"(the -e image, or red) is shown for this many milliseconds " \
+		"before the normal background comes back. If not set (or 0), the " \
+		"error background stays up until you unlock.");
+
+	printf("\n\n\t-b, --blur radius\n\t\tTakes one int parameter. Instead " \
+		"of an image, the background is a screenshot of the desktop taken " \
+		"right before locking, blurred by about 'radius' pixels. Overrides " \
+		"-i. Can be combined with -k.");
+
+	printf("\n\n\t-k, --pixelate size\n\t\tTakes one int parameter. Like " \
+		"-b, but the screenshot is pixelated into blocks of size x size " \
+		"pixels.");
+
+	printf("\n\n\t-R, --ready-fd fd\n\t\tTakes one int parameter, a file " \
+		"descriptor inherited from the caller. Once the lock screen is " \
+		"drawn and both the keyboard and the pointer are grabbed, " \
+		"'locked <ms>' is written to it, <ms> being the time it took to " \
+		"lock. Either way sflock only returns once the screen is locked " \
+		"(exit status 0) or locking failed (exit status 1), so a suspend " \
+		"hook can simply run 'sflock && systemctl suspend'. With -d, " \
+		"'armed <ms>' is written once the daemon takes lock requests.");
+
+	printf("\n\n\t-d, --daemon\n\t\tStarts sflock without locking. " \
+		"Everything is set up once (the window, fonts, images, the " \
+		"password entry) and sflock waits for a lock request on its " \
+		"socket (see -S) or a SIGUSR2. Locking then only has to map the " \
+		"window and grab the input. After the right password sflock " \
+		"waits for the next request instead of exiting. Send 'lock' to " \
+		"the socket to lock, the answer 'locked' (or 'error ...') only " \
+		"comes once the screen is locked: " \
+		"echo lock | nc -U $XDG_RUNTIME_DIR/sflock.sock. Send 'status' " \
+		"to get 'locked' or 'armed' back.");
+
+	printf("\n\n\t-S, --socket path\n\t\tTakes one string parameter, " \
+		"the path of the socket -d listens on. The default is " \
+		"$XDG_RUNTIME_DIR/sflock.sock, or /tmp/sflock-<uid>.sock if " \
+		"XDG_RUNTIME_DIR isn't set.");
+
+	printf("\n\n\t-s, --display display\n\t\tTakes one string parameter, " \
+		"an X display name such as ':0' or ':1.2'. Can be given up to %d " \
+		"times. sflock locks every display given from one process: a name " \
+		"with a screen number locks that screen, one without locks all the " \
+		"screens of the display. Whatever is typed on any of them shows up " \
+		"on all of them, and one password unlocks them all. Without -s " \
+		"every screen of $DISPLAY is locked.", MAXLOCKS);
+
 	printf("\n");
 	exit(0);
 }
 
-/* Draw helper functions (draw_name, draw_line, draw_password) {{{ */
-void draw_name(void) {
-		/*
-		* If the user set a name x value, use that for the x.
-		* If the user did not, use the "override" x if it was set.
-		* If neither were set, use the default value; centered on the
-		* screen. Same applies for the y, except the default for the y
-		* is just above the center of the screen.
-		*/
-		if (use_name_x) x = new_name_x;
-		else if (use_x) x = new_x;
-		// to do: write comment detailing diff between
-		// width and overall.width
+/* What the layout shows (see layout.h) {{{ */
+/*
+ * The indicator lights a segment per keystroke, stepping three segments
+ * at a time so consecutive keys are told apart, in another color for
+ * BackSpace. A password being checked or found wrong takes the ring.
+ */
+int indicator_frame(void) {
+	int f = ind_state;
+
+	if (verifying) f = IndVerify;
+	else if (ind_state == IndKey || ind_state == IndErase)
+		f += ind_keys * 3 % RINGSEGS;
+	return caps_lock ? f + IndLast : f;
+}
+
+/* The password field shows the password characters, or that it's busy */
+void password_text(char **text, int *n) {
+	if (verifying) {
+		*text = verify_text;
+		*n = strlen(verify_text);
+	}
+	else {
+		*text = passdisp;
+		*n = passdisp_off[len];
+	}
+}
+/* }}} */
+
+/*
+ * Returns the Pixmap output 'o' is filled from, scaling the image for it
+ * first if no output of that size has needed it yet. None if 'b' has no
+ * image (or it couldn't be scaled).
+ */
+Pixmap bg_pixmap(struct background *b, int o) {
+	int bw = outputs[o].width, bh = outputs[o].height;
+	struct image fitted;
+	Pixmap pm;
+
+	Visual *vis = DefaultVisual(dpy, screen);
+	int depth = DefaultDepth(dpy, screen);
+
+	if (!b->ok) return None;
+	if (b->shot) return o < b->nscaled ? b->scaled[o].pm : None;
+	/* Tiling doesn't depend on the output size, one copy does for all */
+	if (image_mode == ModeTile) bw = bh = 0;
+	for (int i = 0; i < b->nscaled; i++) {
+		if (b->scaled[i].w == bw && b->scaled[i].h == bh)
+			return b->scaled[i].pm;
+	}
+	if (b->nscaled >= MAXOUTPUTS) return None;
+
+	pm = img_cache_get(dpy, root, vis, depth, b->path, image_mode, bw, bh);
+	if (pm == None) {
+		if (!b->img->data && img_load(dpy, b->path, b->img) == -1) {
+			b->ok = 0;
+			return None;
+		}
+		if (image_mode == ModeTile) {
+			pm = img_cache_put(dpy, root, vis, depth, b->path, image_mode, \
+				bw, bh, b->img);
+		}
 		else {
-			if (use_name_file) {
-				x = ((width - XTextWidth(font, name_file_contents, \
-					strlen(name_file_contents))) / 2);
+			if (img_fit(b->img, &fitted, image_mode, bw, bh) == -1) return None;
+			pm = img_cache_put(dpy, root, vis, depth, b->path, image_mode, \
+				bw, bh, &fitted);
+			img_free(&fitted);
+		}
+	}
+	if (pm == None) return None;
+	b->scaled[b->nscaled].w = bw;
+	b->scaled[b->nscaled].h = bh;
+	b->scaled[b->nscaled++].pm = pm;
+	return pm;
+}
+
+/*
+ * Makes sure every current output has its scaled copy of 'b' and frees
+ * the copies no output uses any more (after an output went away).
+ */
+void prepare_background(struct background *b) {
+	/* The outputs moved, a screenshot doesn't line up anymore */
+	if (b->shot) {
+		free_background(b);
+		return;
+	}
+	for (int i = 0; i < b->nscaled; i++) {
+		int used = image_mode == ModeTile;
+
+		for (int o = 0; o < noutputs; o++) {
+			used |= b->scaled[i].w == outputs[o].width && \
+				b->scaled[i].h == outputs[o].height;
+		}
+		if (!used) {
+			XFreePixmap(dpy, b->scaled[i].pm);
+			b->scaled[i--] = b->scaled[--b->nscaled];
+		}
+	}
+	for (int o = 0; o < noutputs; o++) bg_pixmap(b, o);
+}
+
+void load_background(struct background *b, char *path, struct image *img, \
+	char *warning) {
+	b->path = path;
+	b->img = img;
+	b->ok = 1;
+	prepare_background(b);
+	if (!b->ok) printf("%s", warning);
+}
+
+void free_background(struct background *b) {
+	for (int i = 0; i < b->nscaled; i++)
+		if (b->scaled[i].pm != None) XFreePixmap(dpy, b->scaled[i].pm);
+	b->nscaled = 0;
+}
+
+/*
+ * Makes what every output shows right now, blurred (-b) and/or pixelated
+ * (-k), the normal background. Has to run before the window is mapped.
+ * An output whose capture fails gets the plain background color.
+ */
+void take_screenshot(void) {
+	Visual *vis = DefaultVisual(dpy, screen);
+	int depth = DefaultDepth(dpy, screen);
+	struct image img;
+
+	free_background(&normal_bg);
+	normal_bg.ok = normal_bg.shot = 1;
+	for (int o = 0; o < noutputs; o++) {
+		Pixmap pm = None;
+
+		if (img_capture(dpy, root, vis, depth, outputs[o].x, outputs[o].y, \
+			outputs[o].width, outputs[o].height, &img) == 0) {
+			if (img_blur(&img, blur_radius) == 0) {
+				img_pixelate(&img, pixel_size);
+				pm = img_pixmap(dpy, root, vis, depth, &img);
 			}
-			else
-				x = ((width - XTextWidth(font, username, \
-					strlen(username))) / 2);
+			img_free(&img);
 		}
+		normal_bg.scaled[o].w = outputs[o].width;
+		normal_bg.scaled[o].h = outputs[o].height;
+		normal_bg.scaled[o].pm = pm;
+	}
+	normal_bg.nscaled = noutputs;
+}
+
+/*
+ * Makes 'b' the background, and the solid 'pixel' wherever 'b' has no
+ * pixmap (everywhere if 'b' is NULL)
+ */
+void set_background(struct background *b, unsigned long pixel) {
+	cur_bg = b;
+	cur_pixel = pixel;
+	damage_rect(0, 0, sw, sh);
+}
+
+/* Swaps in the normal background (image or BG_COLOR) on every screen */
+void draw_normal_bg(void) {
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		// Outputs the image doesn't cover get BG_COLOR either way
+		set_background(normal_bg.ok ? &normal_bg : NULL, bgcolor.pixel);
+	}
+}
+
+void draw_error_bg(void) {
+	/*
+	* If the user specified an error background image and it was read
+	* at startup, use it. Otherwise change the background to red.
+	*/
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		set_background(error_bg.ok ? &error_bg : NULL, red.pixel);
+	}
 
-		if (use_name_y) y = new_name_y;
-		else if (use_y) y = new_y;
-		else y = mid_y - ascent - 20;
+	// If the user asked for a flash, put the normal background back later
+	if (error_duration > 0) arm_timer(error_timer, error_duration);
+}
+/* }}} */
+
+/* Output (monitor) helper functions {{{ */
+int same_rect(XRectangle *a, XRectangle *b) {
+	return a->x == b->x && a->y == b->y && \
+		a->width == b->width && a->height == b->height;
+}
 
-		/* Draw username on the lock screen */
-		if (use_name_file) {
-			XDrawString(dpy, w, gc, x + x_shift, y, \
-				name_file_contents, strlen(name_file_contents));
+/*
+ * Fills outputs[] with the area of every active CRTC and picks the one
+ * the prompt goes on: the primary output if there is one, otherwise the
+ * one the pointer is on. Without RandR the whole screen is one output.
+ */
+void query_outputs(void) {
+	XRRScreenResources *res;
+	XRRCrtcInfo *ci;
+	RROutput primary;
+	Window dw;
+	int px, py, di, have_primary = 0;
+	unsigned int du;
+
+	noutputs = 0;
+	prompt_output = 0;
+	if (use_randr && (res = XRRGetScreenResourcesCurrent(dpy, root))) {
+		STAT_COUNT(CtRoundTrip); /* for the resources */
+		STAT_COUNT(CtRoundTrip);
+		primary = XRRGetOutputPrimary(dpy, root);
+		for (int i = 0; i < res->ncrtc && noutputs < MAXOUTPUTS; i++) {
+			STAT_COUNT(CtRoundTrip);
+			if (!(ci = XRRGetCrtcInfo(dpy, res, res->crtcs[i]))) continue;
+			if (ci->mode != None && ci->noutput > 0) {
+				outputs[noutputs].x = ci->x;
+				outputs[noutputs].y = ci->y;
+				outputs[noutputs].width = ci->width;
+				outputs[noutputs].height = ci->height;
+				for (int j = 0; j < ci->noutput; j++) {
+					if (ci->outputs[j] == primary) {
+						prompt_output = noutputs;
+						have_primary = 1;
+					}
+				}
+				noutputs++;
+			}
+			XRRFreeCrtcInfo(ci);
 		}
-		else {
-			XDrawString(dpy, w, gc, x + x_shift, y, \
-				username, strlen(username));
+		XRRFreeScreenResources(res);
+	}
+
+	if (noutputs == 0) {
+		outputs[0].x = outputs[0].y = 0;
+		outputs[0].width = sw;
+		outputs[0].height = sh;
+		noutputs = 1;
+	}
+	else if (!have_primary && \
+		XQueryPointer(dpy, root, &dw, &dw, &px, &py, &di, &di, &du)) {
+		STAT_COUNT(CtRoundTrip);
+		for (int i = 0; i < noutputs; i++) {
+			if (px >= outputs[i].x && px < outputs[i].x + outputs[i].width && \
+				py >= outputs[i].y && py < outputs[i].y + outputs[i].height)
+				prompt_output = i;
 		}
+	}
+
+	ox = outputs[prompt_output].x;
+	oy = outputs[prompt_output].y;
+	width = outputs[prompt_output].width;
+	height = outputs[prompt_output].height;
 }
 
-void draw_line(void) {
-		/*
-		* If the user has set a custom line length, make the line that
-		* length. If the user has NOT set a custom line length, default
-		* to a line 2/8ths the size of the screen.
-		*/
-		if (use_line_length) line_length = new_line_length;
-		else line_length = (width * 2 / 8);
+/*
+ * Handles RRScreenChangeNotify: an output was added, removed or changed
+ * mode. Only outputs whose area changed are repainted, and the prompt is
+ * only laid out again if the output it sits on changed. The window keeps
+ * its grabs throughout, it is just resized if the screen itself grew.
+ */
+void outputs_changed(void) {
+	XRectangle old[MAXOUTPUTS], oldprompt = outputs[prompt_output];
+	int nold = noutputs, found;
+
+	memcpy(old, outputs, sizeof old);
+	if (DisplayWidth(dpy, screen) != sw || DisplayHeight(dpy, screen) != sh) {
+		sw = DisplayWidth(dpy, screen);
+		sh = DisplayHeight(dpy, screen);
+		XResizeWindow(dpy, w, sw, sh);
+		XFreePixmap(dpy, backbuf);
+		backbuf = XCreatePixmap(dpy, w, sw, sh, DefaultDepth(dpy, screen));
+		XftDrawChange(xftdraw, backbuf);
+		damage_rect(0, 0, sw, sh);
+	}
+	query_outputs();
+	/* Scale the backgrounds for new output sizes, drop unused sizes */
+	prepare_background(&normal_bg);
+	prepare_background(&error_bg);
+
+	/* Repaint outputs that appeared or changed, and the area of those gone */
+	for (int i = 0; i < noutputs; i++) {
+		found = 0;
+		for (int j = 0; j < nold; j++) found |= same_rect(&outputs[i], &old[j]);
+		if (!found) damage_rect(outputs[i].x, outputs[i].y, \
+			outputs[i].width, outputs[i].height);
+	}
+	for (int j = 0; j < nold; j++) {
+		found = 0;
+		for (int i = 0; i < noutputs; i++) found |= same_rect(&outputs[i], &old[j]);
+		if (!found) damage_rect(old[j].x, old[j].y, old[j].width, old[j].height);
+	}
 
-		/*
-		* If the user set a line x value, use that for the x.
-		* If the user did not, use the "override" x if it was set.
-		* If neither were set, use the default value; centered on the
-		* screen. Same applies for the y, except the default for the y
-		* is just above the center of the screen.
-		*/
-		if (use_line_x) x = new_line_x;
-		else if (use_x) x = new_x;
-		else x = (width * 3 / 8);
-
-		if (use_line_y) y = new_line_y;
-		else if (use_y) y = new_y;
-		else y = mid_y - ascent - 10;
+	if (!same_rect(&oldprompt, &outputs[prompt_output])) relayout_all();
+}
+/* }}} */
 
-		/*
-		* The line is "anchored" at the top left. So the x given is the
-		* left x coordinate.
-		*/
-		XDrawLine(dpy, w, gc, x + x_shift, y, x + x_shift + line_length, y);
+/* X11 renderer {{{ */
+/*
+ * What layout.c paints with on a real screen: everything goes into the
+ * back buffer, clipped to the damage, and present() copies the painted
+ * box to the window with a single XCopyArea.
+ */
+void x11_extents(const char *s, int n, XGlyphInfo *gi) {
+	XftTextExtentsUtf8(dpy, font, (const FcChar8 *)s, n, gi);
 }
 
-void draw_password(void) {
-		/*
-		* If the user set a password x, use that for the x.
-		* If the user did not, use the "override" x if it was set.
-		* If neither were set, use the default value; centered on the
-		* screen. Same applies for the y, except the default for the y
-		* is just below the center of the screen.
-		*/
+void x11_clip(Region r) {
+	XSetRegion(dpy, gc, r);
+	XftDrawSetClip(xftdraw, r);
+}
 
-		// to do: write comment detailing diff between
-		// width and overall.width
-		if (use_password_x) x = new_password_x;
-		else if (use_x) x = new_x;
-		else x = (width - overall.width) / 2;
+void x11_background(int o, Region r) {
+	Pixmap pm = cur_bg ? bg_pixmap(cur_bg, o) : None;
 
-		if (use_password_y) y = new_password_y;
-		else if (use_y) y = new_y;
-		else y = mid_y;
+	if (pm != None) {
+		XSetTile(dpy, bggc, pm);
+		XSetFillStyle(dpy, bggc, FillTiled);
+	}
+	else {
+		XSetForeground(dpy, bggc, cur_pixel);
+		XSetFillStyle(dpy, bggc, FillSolid);
+	}
+	XSetRegion(dpy, bggc, r);
+	XSetTSOrigin(dpy, bggc, outputs[o].x, outputs[o].y);
+	XFillRectangle(dpy, backbuf, bggc, outputs[o].x, outputs[o].y, \
+		outputs[o].width, outputs[o].height);
+}
 
-		// Draw password entry on the lock screen
-		XDrawString(dpy, w, gc, x + x_shift, y, \
-			passdisp, len);
+void x11_text(int x, int y, const char *s, int n) {
+	XftDrawStringUtf8(xftdraw, &fgcolor, font, x, y, (const FcChar8 *)s, n);
 }
 
-void draw_error_bg(void) {
-	/* If the user specified an error background image */
+void x11_line(int x1, int x2, int y) {
+	XDrawLine(dpy, backbuf, gc, x1, y, x2, y);
+}
+
+void x11_present(const XRectangle *box) {
+	XCopyArea(dpy, backbuf, w, gc, box->x, box->y, box->width, box->height, \
+		box->x, box->y);
+}
+
+/* The indicator frames are uploaded once, with their alpha channel */
+int x11_atlas(int size) {
+	XRenderPictFormat *fmt = XRenderFindStandardFormat(dpy, PictStandardARGB32);
+	struct image img;
+	Pixmap pm;
+
+	if (!fmt || indicator_atlas(&img, size) == -1) return -1;
+	pm = img_pixmap_argb(dpy, root, DefaultVisual(dpy, screen), &img);
+	img_free(&img);
+	if (pm == None) return -1;
+	atlas_pic = XRenderCreatePicture(dpy, pm, fmt, 0, NULL);
+	XFreePixmap(dpy, pm); /* the Picture keeps it alive */
+	sprite_size = size;
+	return 0;
+}
+
+/* One composite of one frame, whatever the size of the screen */
+void x11_sprite(int f, int x, int y) {
+	XRenderComposite(dpy, PictOpOver, atlas_pic, None, \
+		XftDrawPicture(xftdraw), f * sprite_size, 0, 0, 0, x, y, \
+		sprite_size, sprite_size);
+}
+
+struct renderer x11_renderer = {
+	.extents = x11_extents,
+	.clip = x11_clip,
+	.background = x11_background,
+	.text = x11_text,
+	.line = x11_line,
+	.present = x11_present,
+	.atlas = x11_atlas,
+	.sprite = x11_sprite,
+};
+/* }}} */
+
+/* Multiple screen helpers {{{ */
+/* Copies the X globals into 'l' (save), or the other way round */
+void sync_lock(struct lock *l, int save) {
+#define SYNC(v) (save ? memcpy(&l->v, &v, sizeof v) : memcpy(&v, &l->v, sizeof v))
+	SYNC(dpy); SYNC(xc); SYNC(screen); SYNC(root); SYNC(w);
+	SYNC(pmap); SYNC(backbuf); SYNC(invisible); SYNC(bgcolor); SYNC(red);
+	SYNC(font); SYNC(xftdraw); SYNC(fgcolor); SYNC(gc); SYNC(bggc);
+	SYNC(atlas_pic); SYNC(sprite_size);
+	SYNC(use_randr); SYNC(rr_event_base); SYNC(rr_error_base);
+	SYNC(dpms_was_enabled); SYNC(dpms_capable);
+	SYNC(normal_bg); SYNC(error_bg); SYNC(cur_bg); SYNC(cur_pixel);
+	SYNC(x11_renderer);
+#undef SYNC
+}
+
+/*
+ * Makes lock 'i' the one the X globals and the layout belong to. With a
+ * single screen this never has anything to do.
+ */
+void use_lock(int i) {
+	if (i == cur_lock) return;
+	if (cur_lock >= 0) sync_lock(&locks[cur_lock], 1);
+	sync_lock(&locks[i], 0);
+	layout_switch(cur_lock >= 0 ? locks[cur_lock].layout : NULL, \
+		locks[i].layout);
+	cur_lock = i;
+}
+
+/* The lock an event for 'win' on 'd' is about, the display's first if none */
+int lock_of(Display *d, Window win) {
+	int first = -1;
+
+	for (int i = 0; i < nlocks; i++) {
+		if (locks[i].dpy != d) continue;
+		if (locks[i].w == win || locks[i].root == win) return i;
+		if (first == -1) first = i;
+	}
+	return first;
+}
+
+/* What's typed anywhere shows up everywhere, so it's laid out everywhere */
+void relayout_locks(int el) {
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		relayout(el);
+	}
+}
+
+/* Shows 'n' bytes of 's' in the name panel of every screen */
+void set_names(const char *s, int n) {
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		set_name(s, n);
+	}
+}
+
+/*
+ * Sets up the current lock, on 'screen' of 'dpy': its window and back
+ * buffer, the outputs, the font, the colors and the backgrounds. The
+ * decoded background images are shared, every screen only uploads its
+ * own scaled copies.
+ */
+void setup_lock(void) {
+	xcb_alloc_named_color_cookie_t red_cookie, bg_cookie;
+
+    root = RootWindow(dpy, screen);
+    sw = DisplayWidth(dpy, screen);
+    sh = DisplayHeight(dpy, screen);
+
+	/*
+	 * Ask for both colors first and only collect them once the window,
+	 * the outputs and the font have been dealt with, so their round trips
+	 * overlap with that work instead of each waiting for the server.
+	 */
+	xc = XGetXCBConnection(dpy);
+	red_cookie = xcb_alloc_named_color(xc, DefaultColormap(dpy, screen), \
+		strlen(ERROR_COLOR), ERROR_COLOR);
+	bg_cookie = xcb_alloc_named_color(xc, DefaultColormap(dpy, screen), \
+		strlen(BG_COLOR), BG_COLOR);
+	xcb_flush(xc);
+
+    /*
+     * No window background: the server must not clear the window before
+     * an Expose, everything is painted from the back buffer instead.
+     */
+    wa.override_redirect = 1;
+    wa.background_pixmap = None;
+    w = XCreateWindow(dpy, root, 0, 0, sw, sh,
+            0, DefaultDepth(dpy, screen), CopyFromParent,
+            DefaultVisual(dpy, screen), CWOverrideRedirect | CWBackPixmap, &wa);
+    backbuf = XCreatePixmap(dpy, w, sw, sh, DefaultDepth(dpy, screen));
+    damage = XCreateRegion();
+
+	/* Lay out per monitor and follow monitors being (un)plugged */
+	use_randr = XRRQueryExtension(dpy, &rr_event_base, &rr_error_base);
+	if (use_randr) XRRSelectInput(dpy, root, RRScreenChangeNotifyMask);
+	query_outputs();
+	dpms_capable = DPMSCapable(dpy);
+
+    XSelectInput(dpy, w, ExposureMask);
+
+	/* Old style XLFD names still work, anything else is a fontconfig pattern */
+	if (fontname[0] == '-' || fontname[0] == '*')
+		font = XftFontOpenXlfd(dpy, screen, fontname);
+	else
+		font = XftFontOpenName(dpy, screen, fontname);
+
+    if (font == 0) {
+        die("error: could not find font. Try using a full description.\n");
+    }
+	x11_renderer.ascent = font->ascent;
+	x11_renderer.descent = font->descent;
+	rnd = &x11_renderer;
+
+	named_color(red_cookie, &red);
+	named_color(bg_cookie, &bgcolor);
+    pmap = XCreateBitmapFromData(dpy, w, curs, 8, 8);
+    invisible = XCreatePixmapCursor(dpy, pmap, pmap, &bgcolor, &bgcolor, 0, 0);
+    XDefineCursor(dpy, w, invisible);
+
+	/* Copying the back buffer must not generate (No)GraphicsExpose events */
+	values.graphics_exposures = False;
+    gc = XCreateGC(dpy, w, GCGraphicsExposures, &values);
+    bggc = XCreateGC(dpy, w, GCGraphicsExposures, &values);
+	/*
+	 * Read both user specified images now, so that a wrong password
+	 * only has to swap which cached Pixmaps the background comes from.
+	 */
+	if (use_b_image && !use_shot) {
+		load_background(&normal_bg, b_image_loc, &normal_img, \
+			"warning: could not read provided background image\n");
+	}
 	if (use_e_b_image) {
-		/*
-		* Read user specified .xpm file as a Pixmap to 'p'.
-		* If the file was read successfully, set the background,
-		* to the user specified image. If the file was not read
-		* successfully, print a warning message.
-		*/
-		int retval = XpmReadFileToPixmap(dpy, w, e_b_image_loc, \
-			&p, NULL, NULL);
+		load_background(&error_bg, e_b_image_loc, &error_img, wrn_error_bg);
+	}
+	xftdraw = XftDrawCreate(dpy, backbuf, DefaultVisual(dpy, screen), \
+		DefaultColormap(dpy, screen));
+	if (!XftColorAllocName(dpy, DefaultVisual(dpy, screen), \
+		DefaultColormap(dpy, screen), TEXT_COLOR, &fgcolor))
+		die("error: could not allocate text color.\n");
+	/* The line is drawn in the text color too */
+    XSetForeground(dpy, gc, fgcolor.pixel);
+	if (show_indicator && rnd->atlas(indicator_size) == -1) {
+#ifdef STATIC_LAYOUT
+		die("error: could not draw the indicator.\n");
+#else
+		fprintf(stderr, "warning: could not draw the indicator\n");
+		show_indicator = 0;
+#endif
+	}
+	/* Everything that identifies the lock is in place, keep it there */
+	sync_lock(&locks[cur_lock], 1);
+}
 
-		if (retval == 0) XSetWindowBackgroundPixmap(dpy, w, p);
-		else printf(wrn_error_bg);
+/*
+ * Connects to the display 'name' (NULL for $DISPLAY) and locks the screen
+ * it names, or every screen it has if it names none (":0" but not ":0.1").
+ */
+void open_display(const char *name) {
+	const char *s = name ? name : getenv("DISPLAY");
+	Display *d;
+	int first = 0, last;
+
+	if (!(d = XOpenDisplay(name)))
+		die("sflock: cannot open display %s\n", XDisplayName(name));
+	last = ScreenCount(d) - 1;
+	if (s && (s = strrchr(s, ':')) && strchr(s, '.'))
+		first = last = DefaultScreen(d);
+	display_locks[ndisplays++] = nlocks;
+	for (int i = first; i <= last; i++) {
+		if (nlocks == MAXLOCKS)
+			die("sflock: cannot lock more than %d screens\n", MAXLOCKS);
+		if (!(locks[nlocks].layout = layout_new()))
+			die("sflock: out of memory\n");
+		locks[nlocks].x11_renderer = x11_renderer;
+		use_lock(nlocks++);
+		dpy = d;
+		screen = i;
+		setup_lock();
 	}
-	else {
-		// change background on wrong password
-		XSetWindowBackground(dpy, w, red.pixel);
+}
+/* }}} */
+
+/* Power helpers {{{ */
+/*
+ * Stops (or restarts) reading the name while the display is off, so
+ * nothing wakes sflock up. Whatever changed meanwhile is read on resume.
+ */
+void pause_name(int pause) {
+	int fd = name_file_fd != -1 ? name_file_fd : name_fd;
+
+	if (use_name_file && name_file_fd == -1) {
+		if (pause) disarm_timer(name_file_timer);
+		else arm_timer(name_file_timer, 1000);
+	}
+	// A stream that ended is reopened as soon as the display is back on
+	if (use_name_stream && name_fd == -1) {
+		if (pause) disarm_timer(name_stream_timer);
+		else arm_timer(name_stream_timer, 0);
+	}
+	if (fd != -1 && (use_name_file || use_name_stream)) {
+		if (pause) remove_watch(fd);
+		else add_watch(fd, use_name_file ? name_file_changed : name_stream_read);
+	}
+	if (!pause && use_name_file) read_file();
+}
+
+/* Applies the DPMS side of 'state' to every display that can do it */
+void set_dpms(int state) {
+	CARD16 level;
+
+	for (int d = 0; d < ndisplays; d++) {
+		use_lock(display_locks[d]);
+		if (!dpms_capable) continue;
+		if (power == PowerActive) {
+			DPMSInfo(dpy, &level, &dpms_was_enabled);
+			if (!dpms_was_enabled) DPMSEnable(dpy);
+		}
+		switch (state) {
+			case PowerActive:
+				DPMSForceLevel(dpy, DPMSModeOn);
+				if (!dpms_was_enabled) DPMSDisable(dpy);
+				break;
+			case PowerDimmed:
+				DPMSForceLevel(dpy, DPMSModeStandby);
+				break;
+			case PowerOff:
+				DPMSForceLevel(dpy, DPMSModeOff);
+				break;
+		}
+		XFlush(dpy);
+	}
+}
+
+/*
+ * Moves between active, dimmed (DPMS standby) and off. The DPMS request
+ * goes out once per change to every display that can do DPMS; while off
+ * nothing is read or drawn on those, and only input (see wake_up())
+ * brings them back.
+ */
+void set_power(int state) {
+	if (state == power) return;
+	if (state == PowerOff) {
+		pause_name(1);
+		disarm_timer(widget_timer);
+	}
+	if (power == PowerOff) {
+		pause_name(0);
+		if (locked) widget_tick();
+	}
+	DEBUG("power %d -> %d\n", power, state);
+	set_dpms(state);
+	power = state;
+
+	switch (state) {
+		case PowerActive:
+			if (idle_time > 0) arm_timer(idle_timer, idle_time * 1000);
+			break;
+		case PowerDimmed:
+			arm_timer(idle_timer, idle_time * 1000);
+			break;
+		case PowerOff:
+			disarm_timer(idle_timer);
+			break;
+	}
+}
+
+/* Can any of the displays be dimmed and switched off? */
+int any_dpms(void) {
+	for (int i = 0; i < nlocks; i++)
+		if (locks[i].dpms_capable) return 1;
+	return 0;
+}
+
+/* Runs when there was no input for -I seconds: dim, then switch off */
+void idle_tick(void) {
+	if (any_dpms())
+		set_power(power == PowerActive ? PowerDimmed : PowerOff);
+}
+
+/* Any input while locked: back to active, and the idle time starts over */
+void wake_up(void) {
+	if (power != PowerActive) set_power(PowerActive);
+	else if (idle_time > 0) arm_timer(idle_timer, idle_time * 1000);
+}
+/* }}} */
+
+/* Event handling {{{ */
+/* Applies one key press to the password buffer */
+void handle_key(XKeyEvent *ke) {
+	DEBUG("keypress is keypress\n");
+	wake_up();
+
+	STAT_START(td);
+	buf[0] = 0;
+	num = XLookupString(ke, buf, sizeof buf, &ksym, 0);
+	if(IsKeypadKey(ksym)) {
+		if(ksym == XK_KP_Enter)
+			ksym = XK_Return;
+		else if(ksym >= XK_KP_0 && ksym <= XK_KP_9)
+			ksym = (ksym - XK_KP_0) + XK_0;
+	}
+	STAT_END(StDecode, td);
+	// The state is from before this key, Caps_Lock itself flips it
+	caps_lock = !!(ke->state & LockMask) ^ (ksym == XK_Caps_Lock);
+	if(IsFunctionKey(ksym) || IsKeypadKey(ksym) || IsMiscFunctionKey(ksym) || IsPFKey(ksym) || IsPrivateKeypadKey(ksym)) {
+		DEBUG("jfkldsjkfjdklasjfkljdksjfklj is function\n");
+		return;
+	}
+	/*
+	 * Keys typed while a password is being checked are dropped
+	 * (Escape still blanks the screen). Keeping them would put
+	 * them in front of the next attempt if this one is wrong.
+	 */
+	if (verifying && ksym != XK_Escape) return;
+
+	switch(ksym) {
+		case XK_Return:
+			// Checked in the background, see auth_done()
+			start_auth();
+			len = 0;
+			ind_state = IndIdle;
+			break;
+		case XK_Escape:
+			/*
+			 * Switch the display off once the key is up again: the
+			 * server switches DPMS back on for any input, the release
+			 * included.
+			 */
+			if (any_dpms()) {
+				blank_dpy = dpy;
+				blank_key = ke->keycode;
+			}
+			len = 0;
+			ind_state = IndIdle;
+			break;
+		case XK_BackSpace:
+			if(len) {
+				--len;
+				ind_state = IndErase;
+				ind_keys++;
+			}
+			break;
+		default:
+			if(num && !iscntrl((int) buf[0]) && (len + num < sizeof passwd)) {
+				memcpy(passwd + len, buf, num);
+				len += num;
+				ind_state = IndKey;
+				ind_keys++;
+			}
+			break;
 	}
+	// The password field is laid out once for the whole batch of events
+	typed = 1;
+}
 
-	// Flush to update background
-	XFlush(dpy);
+/* Handles any event but MotionNotify, which the main loop collapses */
+void handle_event(XEvent *e) {
+	// Work on the screen the event is from
+	use_lock(lock_of(e->xany.display, e->xany.window));
+	// If the window was (partly) uncovered, draw that part again
+	if (e->type == Expose)
+		damage_rect(e->xexpose.x, e->xexpose.y, \
+			e->xexpose.width, e->xexpose.height);
+	// If a monitor was added, removed or changed mode, follow it
+	if (use_randr && e->type == rr_event_base + RRScreenChangeNotify) {
+		XRRUpdateConfiguration(e);
+		outputs_changed();
+	}
+	// If the mouse was clicked, wake up
+	if (e->type == ButtonPress) wake_up();
+	if (e->type == KeyPress) handle_key(&e->xkey);
+	// Escape was let go, see handle_key()
+	if (e->type == KeyRelease && e->xkey.display == blank_dpy && \
+		e->xkey.keycode == blank_key) {
+		blank_dpy = NULL;
+		set_power(PowerOff);
+	}
 }
 /* }}} */
 
-// {{{
-void update_screen(void) {
+/* Locking and daemon mode helpers {{{ */
+/*
+ * VT_(UN)LOCKSWITCH needs root. get_password() only swapped root into
+ * the real uid, so swap it back for the ioctl and out again after.
+ */
+void lock_vt(int lock) {
+	uid_t ruid = getuid(), euid = geteuid();
+
+	if (term == -1) return;
+	if (ruid != euid && setreuid(euid, ruid) == -1) return;
+	if (ioctl(term, lock ? VT_LOCKSWITCH : VT_UNLOCKSWITCH) == -1)
+		perror(lock ? "error locking console" : "error unlocking console");
+	if (ruid != euid && setreuid(ruid, euid) == -1)
+		die("sflock: cannot drop privileges\n");
+}
 
-	XClearWindow(dpy, w);
-	XTextExtents (font, passdisp, len, &dir, &ascent, \
-	&descent, &overall);
+/* Answers every lock request waiting for the lock with 'msg' */
+void reply_waiters(const char *msg) {
+	for (int i = 0; i < nwaiters; i++) {
+		if (write(waiters[i], msg, strlen(msg)) == -1) { /* client gone */ }
+		close(waiters[i]);
+	}
+	nwaiters = 0;
+}
 
-	mid_y = (height + ascent - descent) / 2;
+/*
+ * Covers the screen and takes the input. Returns 1 once the window is
+ * mapped, both grabs are held and the first frame has been painted, 0 if
+ * the input couldn't be grabbed. In daemon mode everything else was set
+ * up long before, so this is all that sits between a request and a lock.
+ */
+int lock_screen(void) {
+	if (daemon_mode) lock_vt(1);
+	len = 0;
+	ind_state = IndIdle;
+	disarm_timer(error_timer);
+	wake_up();
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		if (use_shot) take_screenshot();
+	}
+	draw_normal_bg();
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		XMapRaised(dpy, w);
+	}
+	/* The keyboard and the pointer belong to a display, not a screen */
+	for (int d = 0; d < ndisplays; d++) {
+		use_lock(display_locks[d]);
+		if (grab_input()) continue;
+		if (daemon_mode) {
+			unlock_screen();
+			reply_waiters("error cannot grab input\n");
+		}
+		return 0;
+	}
+	locked = 1;
+	widget_tick();
+
+	/* Paint the first frames before saying the screens are locked */
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		relayout_all();
+		damage_rect(0, 0, sw, sh);
+		update_screen();
+	}
+	for (int d = 0; d < ndisplays; d++) {
+		use_lock(display_locks[d]);
+		XSync(dpy, False);
+		STAT_COUNT(CtRoundTrip);
+	}
+	if (daemon_mode) reply_waiters("locked\n");
+	else notify_ready();
+	return 1;
+}
 
-	/* If the user HASN'T set the username to be hidden */
-	if (show_name) {
-		draw_name();
+/* Gives the screen and the input back, a daemon is armed again after */
+void unlock_screen(void) {
+	locked = 0;
+	blank_dpy = NULL;
+	set_power(PowerActive);
+	disarm_timer(idle_timer);
+	disarm_timer(widget_timer);
+	wipe(passwd, sizeof passwd);
+	len = 0;
+	for (int i = 0; i < nlocks; i++) {
+		use_lock(i);
+		XUngrabKeyboard(dpy, CurrentTime);
+		XUngrabPointer(dpy, CurrentTime);
+		XUnmapWindow(dpy, w);
+		XFlush(dpy);
 	}
+	lock_vt(0);
+}
+
+void daemon_reply(int fd, const char *msg) {
+	if (write(fd, msg, strlen(msg)) == -1) { /* client gone */ }
+	close(fd);
+}
 
-	// If the user HASN'T set the line to be hidden
-	if (show_line) {
-		draw_line();
+/* Handles one request ("lock" or "status") from a socket client */
+void daemon_request(int fd) {
+	char buf[64];
+	ssize_t n = read(fd, buf, sizeof buf - 1);
+
+	remove_watch(fd);
+	if (n <= 0) {
+		close(fd);
+		return;
+	}
+	buf[n] = '\0';
+	if (strncmp(buf, "status", 6) == 0)
+		daemon_reply(fd, locked ? "locked\n" : "armed\n");
+	else if (strncmp(buf, "lock", 4) != 0)
+		daemon_reply(fd, "error unknown request\n");
+	else if (locked)
+		daemon_reply(fd, "locked\n");
+	else if (nwaiters == MAXCLIENTS)
+		daemon_reply(fd, "error busy\n");
+	else {
+		/* The answer comes from lock_screen() */
+		waiters[nwaiters++] = fd;
+		lock_screen();
 	}
+}
+
+void daemon_accept(int fd) {
+	int c = accept(fd, NULL, NULL);
 
-	/* If the user HASN'T set the password field to be hidden */
-	if (show_password) {
-		draw_password();
+	if (c == -1) return;
+	if (nwatches == MAXWATCHES) {
+		daemon_reply(c, "error busy\n");
+		return;
 	}
+	fcntl(c, F_SETFL, O_NONBLOCK);
+	fcntl(c, F_SETFD, FD_CLOEXEC);
+	add_watch(c, daemon_request);
 }
-// }}}
+
+void lock_signalled(int fd) {
+	char buf[16];
+
+	while (read(fd, buf, sizeof buf) > 0);
+	if (!locked) lock_screen();
+}
+
+void on_usr2(int sig) {
+	int saved = errno;
+
+	if (write(lock_sigpipe[1], "", 1) == -1) { /* a lock is pending */ }
+	errno = saved;
+}
+
+/* Listens for lock requests on the socket and for SIGUSR2 */
+void start_daemon(void) {
+	static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct sockaddr_un sa;
+	struct sigaction sig;
+	mode_t mask;
+	int fd;
+
+	if (!socket_path) {
+		if (getenv("XDG_RUNTIME_DIR"))
+			snprintf(path, sizeof path, "%s/sflock.sock", \
+				getenv("XDG_RUNTIME_DIR"));
+		else
+			snprintf(path, sizeof path, "/tmp/sflock-%d.sock", (int)geteuid());
+		socket_path = path;
+	}
+	if (strlen(socket_path) >= sizeof sa.sun_path)
+		die("sflock: socket path too long\n");
+	/* Someone still answering there is another sflock, not a leftover */
+	if ((fd = connect_name_socket(socket_path)) != -1)
+		die("sflock: already running on %s\n", socket_path);
+	unlink(socket_path);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, socket_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		die("sflock: cannot create socket\n");
+	/* Only the user may lock (or ask) */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1 || \
+		listen(fd, MAXCLIENTS) == -1)
+		die("sflock: cannot listen on %s: %s\n", socket_path, strerror(errno));
+	umask(mask);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	add_watch(fd, daemon_accept);
+
+	if (pipe(lock_sigpipe) == -1)
+		die("sflock: cannot create pipe\n");
+	fcntl(lock_sigpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(lock_sigpipe[1], F_SETFL, O_NONBLOCK);
+	add_watch(lock_sigpipe[0], lock_signalled);
+	memset(&sig, 0, sizeof sig);
+	sig.sa_handler = on_usr2;
+	sig.sa_flags = SA_RESTART;
+	sigemptyset(&sig.sa_mask);
+	sigaction(SIGUSR2, &sig, NULL);
+}
+/* }}} */
 
 int
 main(int argc, char **argv) {
 	int opt;
+
+	start_ms = now_ms();
 	/* still to do:
 		x-coord and x-shift should be for individual part? (password field,
 		line and name?) y-shift isn't implemented either in the while loop
@@ -466,17 +2157,64 @@ main(int argc, char **argv) {
 		{ "line-y",				required_argument,	NULL,	'E' },
 		{ "password-y",			required_argument,	NULL,	'F' },
 		{ "name-file",			required_argument,	NULL,	'N' },
+		{ "name-cmd",			required_argument,	NULL,	'P' },
+		/* widget options */
+		{ "clock",				required_argument,	NULL,	't' },
+		{ "date",				required_argument,	NULL,	'u' },
+		{ "hostname",			no_argument,		NULL,	'H' },
+		{ "battery",			no_argument,		NULL,	'K' },
+		{ "clock-pos",			required_argument,	NULL,	OPTPOS + ElClock },
+		{ "date-pos",			required_argument,	NULL,	OPTPOS + ElDate },
+		{ "hostname-pos",		required_argument,	NULL,	OPTPOS + ElHost },
+		{ "battery-pos",		required_argument,	NULL,	OPTPOS + ElBattery },
+		{ "indicator",			required_argument,	NULL,	'g' },
+		{ "indicator-pos",		required_argument,	NULL,	OPTPOS + ElIndicator },
 		/* image options */
 		{ "background-image",	required_argument,	NULL,	'i' },
 		{ "error-image",		required_argument,	NULL,	'e' },
+		{ "error-time",			required_argument,	NULL,	'T' },
+		{ "idle-time",			required_argument,	NULL,	'I' },
+		{ "image-mode",			required_argument,	NULL,	'M' },
+		{ "blur",				required_argument,	NULL,	'b' },
+		{ "pixelate",			required_argument,	NULL,	'k' },
+		/* process options */
+		{ "ready-fd",			required_argument,	NULL,	'R' },
+		{ "daemon",				no_argument,		NULL,	'd' },
+		{ "socket",				required_argument,	NULL,	'S' },
+		{ "display",			required_argument,	NULL,	's' },
 		{ 0, 0, 0, 0 }
 	};
 
 	while ((opt = getopt_long(argc, argv, \
-		"c:f:nlpoL:hvx:y:X:Y:A:B:C:D:E:F:N:i:e:", opt_table, NULL)) != -1) {
+		"c:f:nlpoL:hvx:y:X:Y:A:B:C:D:E:F:N:P:t:u:HKg:i:e:T:I:M:b:k:R:dS:s:", opt_table, NULL)) != -1) {
 		switch (opt) {
 			case 'c': passchar = optarg; break;
 			case 'f': fontname = optarg; break;
+			// help and info options
+			case 'h': print_help(); break;
+			case 'v':
+				die("sflock-"VERSION", © 2015 Ben Ruijl, " \
+				"JSpeedie\n"); break;
+			// name options
+			case 'N':
+				use_name_file = 1;
+				name_file = optarg; break;
+			case 'P':
+				use_name_stream = 1;
+				name_cmd = optarg; break;
+#ifdef STATIC_LAYOUT
+			case 'n': case 'l': case 'p': case 'o': case 'L':
+			case 'x': case 'y': case 'X': case 'Y':
+			case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+			case 't': case 'u': case 'H': case 'K': case 'g':
+			case OPTPOS + ElIndicator:
+			case OPTPOS + ElClock:
+			case OPTPOS + ElDate:
+			case OPTPOS + ElHost:
+			case OPTPOS + ElBattery:
+				die("error: this sflock was built with a fixed layout, " \
+					"see config.h.\n"); break;
+#else
 			// show/hide element options
 			case 'n': show_name = 0; break;
 			case 'l': show_line = 0; break;
@@ -486,11 +2224,6 @@ main(int argc, char **argv) {
 			case 'L':
 				use_line_length = 1;
 				new_line_length = atoi(optarg); break;
-			// help and info options
-			case 'h': print_help(); break;
-			case 'v':
-				die("sflock-"VERSION", © 2015 Ben Ruijl, " \
-				"JSpeedie\n"); break;
 			// location options
 			case 'x':
 				use_x = 1;
@@ -520,28 +2253,89 @@ main(int argc, char **argv) {
 			case 'F':
 				use_password_y = 1;
 				new_password_y = atoi(optarg); break;
-			case 'N':
-				use_name_file = 1;
-				name_file = optarg; break;
+			// widget options
+			case 't':
+				show_clock = 1;
+				clock_fmt = optarg; break;
+			case 'u':
+				show_date = 1;
+				date_fmt = optarg; break;
+			case 'H': show_host = 1; break;
+			case 'K': show_battery = 1; break;
+			case 'g':
+				show_indicator = 1;
+				indicator_size = atoi(optarg);
+				if (indicator_size < 16 || indicator_size > 400)
+					die("error: the indicator size must be 16 to 400.\n");
+				break;
+			case OPTPOS + ElIndicator:
+			case OPTPOS + ElClock:
+			case OPTPOS + ElDate:
+			case OPTPOS + ElHost:
+			case OPTPOS + ElBattery:
+				if (sscanf(optarg, "%d,%d", &new_widget_x[opt - OPTPOS], \
+					&new_widget_y[opt - OPTPOS]) != 2)
+					die("error: '%s' is not x,y.\n", optarg);
+				use_widget_pos[opt - OPTPOS] = 1; break;
+#endif
 			// image options
-			case 'i':
-				use_b_image = 1;
-				b_image_loc = optarg; break;
-			case 'e':
-				use_e_b_image = 1;
-				e_b_image_loc = optarg; break;
+			case 'i': b_image_loc = optarg; break;
+			case 'e': e_b_image_loc = optarg; break;
+			case 'T': error_duration = atoi(optarg); break;
+			case 'I': idle_time = atoi(optarg); break;
+			case 'M':
+				if ((image_mode = img_mode(optarg)) == -1)
+					die("error: unknown image mode '%s'.\n", optarg);
+				break;
+			case 'b': blur_radius = atoi(optarg); break;
+			case 'k': pixel_size = atoi(optarg); break;
+			// process options
+			case 'R': ready_fd = atoi(optarg); break;
+			case 'd': daemon_mode = 1; break;
+			case 'S': socket_path = optarg; break;
+			case 's':
+				if (ndisplay_names == MAXLOCKS)
+					die("error: at most %d displays can be given.\n", MAXLOCKS);
+				display_names[ndisplay_names++] = optarg; break;
 		}
 	}
 
-	/* If the user set the -N option, read the file they specified */
-	if (use_name_file) {
-		read_file();
+	use_b_image = b_image_loc[0] != '\0';
+	use_e_b_image = e_b_image_loc[0] != '\0';
+	use_shot = blur_radius > 0 || pixel_size > 1;
+	/* A FIFO or socket given to -N is streamed like --name-cmd output */
+	if (use_name_file && (use_name_stream || is_stream(name_file))) {
+		use_name_file = 0;
+		use_name_stream = 1;
 	}
+	/*
+	 * Widgets tick every minute unless a format shows seconds, or the
+	 * battery needs reading more often
+	 */
+	if ((show_clock && shows_seconds(clock_fmt)) || \
+		(show_date && shows_seconds(date_fmt)))
+		widget_period = 1;
+	if (show_battery && widget_period > BATTERYSECS)
+		widget_period = BATTERYSECS;
+	/* Without a host name the widget goes, or stays empty if it's fixed */
+	if (show_host && gethostname(widget_texts[ElHost], WIDGETTEXT - 1) == -1)
+#ifdef STATIC_LAYOUT
+		widget_texts[ElHost][0] = '\0';
+#else
+		show_host = 0;
+#endif
+	if (show_battery) find_battery();
 
-    // fill with password characters
-    for (int i = 0; i < sizeof passdisp; i+= strlen(passchar))
-        for (int j = 0; j < strlen(passchar) && i + j < sizeof passdisp; j++)
-            passdisp[i + j] = passchar[j];
+    // fill with password characters, one whole UTF-8 character at a time
+	for (int i = 0, j = 0, k = 0; i < 256; i++) {
+		int n = utf8_len(passchar + j);
+
+		memcpy(passdisp + k, passchar + j, n);
+		k += n;
+		passdisp_off[i + 1] = k;
+		j += n;
+		if (passchar[j] == '\0') j = 0;
+	}
 
 
     /* disable tty switching */
@@ -549,16 +2343,22 @@ main(int argc, char **argv) {
         perror("error opening console");
     }
 
-    if ((ioctl(term, VT_LOCKSWITCH)) == -1) {
+    /* A daemon (-d) only does this when it locks, see lock_vt() */
+    if (!daemon_mode && (ioctl(term, VT_LOCKSWITCH)) == -1) {
         perror("error locking console");
     }
 
-    /* deamonize */
+    /* deamonize, the parent waits until the screen is actually locked */
+    if (pipe(ready_pipe) == -1)
+        die("sflock: cannot create pipe\n");
     pid = fork();
     if (pid < 0)
         die("Could not fork sflock.");
     if (pid > 0)
-        exit(0); // exit parent
+        wait_ready(); // exit parent
+    close(ready_pipe[0]);
+    /* Only the parent reports on -R, don't keep the reader waiting for EOF */
+    if (ready_fd != -1) close(ready_fd);
 
 #ifndef HAVE_BSD_AUTH
     pws = get_password();
@@ -567,172 +2367,108 @@ main(int argc, char **argv) {
     username = getlogin();
 #endif
 
-    if(!(dpy = XOpenDisplay(0)))
-        die("sflock: cannot open dpy\n");
-
-    screen = DefaultScreen(dpy);
-    root = RootWindow(dpy, screen);
-    width = DisplayWidth(dpy, screen);
-    height = DisplayHeight(dpy, screen);
-
-    wa.override_redirect = 1;
-    wa.background_pixel = XBlackPixel(dpy, screen);
-    w = XCreateWindow(dpy, root, 0, 0, width, height,
-            0, DefaultDepth(dpy, screen), CopyFromParent,
-            DefaultVisual(dpy, screen), CWOverrideRedirect | CWBackPixel, &wa);
-
-    XAllocNamedColor(dpy, DefaultColormap(dpy, screen), \
-		"orange red", &red, &dummy);
-    XAllocNamedColor(dpy, DefaultColormap(dpy, screen), \
-		"black", &black, &dummy);
-    pmap = XCreateBitmapFromData(dpy, w, curs, 8, 8);
-    invisible = XCreatePixmapCursor(dpy, pmap, pmap, &black, &black, 0, 0);
-    XDefineCursor(dpy, w, invisible);
-    XMapRaised(dpy, w);
-
-    font = XLoadQueryFont(dpy, fontname);
-
-    if (font == 0) {
-        die("error: could not find font. Try using a full description.\n");
-    }
-
-    gc = XCreateGC(dpy, w, (unsigned long)0, &values);
-	if (use_b_image) {
-		// Read user specified .xpm file as a Pixmap to 'p'
-		int retval = XpmReadFileToPixmap (dpy, w, b_image_loc, \
-			&bg, NULL, NULL);
-		// If reading the pixmap was successful
-		if (retval == 0) XSetWindowBackgroundPixmap(dpy, w, bg);
-		else printf("warning: could not read " \
-			"provided background image\n");
-	}
-    XSetFont(dpy, gc, font->fid);
-    XSetForeground(dpy, gc, XWhitePixel(dpy, screen));
-
-	/* tries to grab the mouse every millisecond? Attempted 1000 times? */
-    for(len = 1000; len; len--) {
-		printf("len %d\n", len);
-        if(XGrabPointer(dpy, root, False, ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                    GrabModeAsync, GrabModeAsync, None, invisible, CurrentTime) == GrabSuccess)
-            break;
-        usleep(1000);
-    }
+    /* Lock the screens asked for with -s, or every screen of $DISPLAY */
+    if (ndisplay_names == 0) display_names[ndisplay_names++] = NULL;
+    for (int i = 0; i < ndisplay_names; i++) open_display(display_names[i]);
+	draw_normal_bg();
+	error_timer = add_timer(draw_normal_bg);
+	idle_timer = add_timer(idle_tick);
+	widget_timer = add_timer(widget_tick);
+	/* If the user set the -N option, read the file they specified */
+	if (use_name_file) read_file();
+	else if (!use_name_stream) set_names(username, strlen(username));
 
-	/* seems to be the same as above. Tries to grab the keyboard every
-	 * millisecond. Tries 1000 times. Difference is that after this loop
-	 * it sets "running" to true only if len > 0 (if the keyboard was grabbed
-	 * within 1000 attempts)
-	 */
-    if((running = running && (len > 0))) {
-        for(len = 1000; len; len--) {
-            if(XGrabKeyboard(dpy, root, True, GrabModeAsync, \
-			GrabModeAsync, CurrentTime) == GrabSuccess)
-                break;
-            usleep(1000);
-        }
-        running = (len > 0);
-    }
+#ifdef STATS
+	/* Dump the stats on SIGUSR1 (and at exit) */
+	if ((opt = stats_init()) != -1) add_watch(opt, stats_dump);
+#endif
+	if (pipe(auth_pipe) == -1)
+		die("sflock: cannot create pipe\n");
+	add_watch(auth_pipe[0], auth_done);
+	/* Redraw the name field whenever the name file changes on disk */
+	if (use_name_file) watch_name_file();
+	if (use_name_stream) {
+		name_stream_timer = add_timer(open_name_stream);
+		open_name_stream();
+	}
 
-    len = 0;
-    XSync(dpy, False);
-    update = True;
-    sleepmode = False;
+	/* Everything is in place, what's left is what a daemon does per lock */
+	if (daemon_mode) {
+		start_daemon();
+		notify_ready();
+	}
+	else running = lock_screen();
 
     /* main event loop */
 	/* while running != 0 */
-	int thing = 0;
+	int motion, pending;
 	/* while the user has not entered the correct password */
     while (running) {
-		printf("while\n");
-
-		/* re-read the file in case it's changed */
-		if (use_name_file) read_file();
-		/* Draw the name, line, and password */
-		if (update) update_screen();
-
-		// If the user pressed Esc, sleep (screen goes black)
-		if (sleepmode) {
-			printf("sleeping thingy\n");
-			DPMSEnable(dpy);
-			DPMSForceLevel(dpy, DPMSModeOff);
-			XFlush(dpy);
+		DEBUG("while\n");
+
+		/* Draw the name, line, and password, and send it off right away */
+		for (int i = 0; i < nlocks; i++) {
+			use_lock(i);
+			// Screens whose display can't switch off stay up to date
+			if (update && locked && (power != PowerOff || !dpms_capable)) {
+				update_screen();
+				STAT_START(t);
+				XFlush(dpy);
+				STAT_END(StFlush, t);
+			}
 		}
 
-		/* If there are more than 0 X events yet to be removed from the queue */
-		if (XPending(dpy) > 0) {
-			printf("XPending triggered :^]\n");
-			/* Set "ev" to have all the XEvent info */
-			XNextEvent(dpy, &ev);
-			// If the mouse was moved, wake up
-			if (ev.type == MotionNotify) sleepmode = False;
-
-			if(ev.type == KeyPress) {
-				printf("keypress is keypress\n");
-				sleepmode = False;
-
-				buf[0] = 0;
-				num = XLookupString(&ev.xkey, buf, sizeof buf, &ksym, 0);
-				if(IsKeypadKey(ksym)) {
-					if(ksym == XK_KP_Enter)
-						ksym = XK_Return;
-					else if(ksym >= XK_KP_0 && ksym <= XK_KP_9)
-						ksym = (ksym - XK_KP_0) + XK_0;
-				}
-				if(IsFunctionKey(ksym) || IsKeypadKey(ksym) || IsMiscFunctionKey(ksym) || IsPFKey(ksym) || IsPrivateKeypadKey(ksym)) {
-					printf("jfkldsjkfjdklasjfkljdksjfklj is function\n");
-					continue;
-				}
+		/*
+		 * Sleep until a server sends us something or a timer is due.
+		 * XPending() flushes our output and picks up anything already
+		 * sitting on the socket, so only block when every Xlib queue is
+		 * empty.
+		 */
+		pending = 0;
+		for (int d = 0; d < ndisplays; d++)
+			pending += XPending(locks[display_locks[d]].dpy);
+		if (pending == 0) {
+			wait_for_events();
+			run_timers();
+		}
 
-				switch(ksym) {
-					case XK_Return:
-						passwd[len] = 0;
-#ifdef HAVE_BSD_AUTH
-	running = !auth_userokay(getlogin(), NULL, "auth-xlock", passwd);
-#else
-	running = strcmp(crypt(passwd, pws), pws);
-#endif
-						printf("running after checking pass %d\n", running);
-						// If the password the user entered was incorrect
-						if (running != 0) draw_error_bg();
-						len = 0;
-						break;
-					case XK_Escape:
-						if (DPMSCapable(dpy)) sleepmode = True;
-						len = 0;
-						break;
-					case XK_BackSpace:
-						if(len) --len;
-						break;
-					default:
-						if(num && !iscntrl((int) buf[0]) && (len + num < sizeof passwd)) {
-							memcpy(passwd + len, buf, num);
-							len += num;
-						}
-						break;
+		/*
+		 * Handle everything that's queued before drawing again, so a burst
+		 * of keys or a fast mouse costs one redraw and one flush. Motion
+		 * only matters for waking the display up, so a run of it counts
+		 * once. Handlers switch locks, so each display is read through
+		 * its own pointer rather than dpy.
+		 */
+		for (int d = 0; running && d < ndisplays; d++) {
+			Display *dd = locks[display_locks[d]].dpy;
+
+			motion = 0;
+			while (running && XEventsQueued(dd, QueuedAfterReading) > 0) {
+				DEBUG("XPending triggered :^]\n");
+				/* Set "ev" to have all the XEvent info */
+				STAT_START(tq);
+				XNextEvent(dd, &ev);
+				STAT_END(StDequeue, tq);
+				STAT_COUNT(CtEvent);
+				if (ev.type != MotionNotify) {
+					handle_event(&ev);
+					motion = 0;
+				}
+				else if (!motion) {
+					wake_up();
+					motion = 1;
 				}
 			}
-			// update = True; // show changes
 		}
-		/*
-		 * If there are no X events to clear, pause very briefly before running
-		 * through the loop again.
-		 * to do: should probably allow the user to set the refresh speed
-		 * in case their system is slow. Maybe add option to not redraw screen
-		 * at all (except on XEvent circa before I forked)
-		 */
-		else {
-			usleep(1000);
+		if (typed) {
+			relayout_locks(ElPassword); // show changes everywhere
+			relayout_locks(ElIndicator);
+			typed = 0;
 		}
-		// update = True; // show changes
-		printf("\nthing %d\n", thing);
-		thing = thing + 1;
-		// I've locked myself out of my system once by accident and I'm not
-		// letting that happen again. Until I finish my work on the main loop,
-		// this remains
-		if (thing >= 500000) break;
     }
 
     /* free and unlock */
+	if (use_name_stream) close_name_stream();
     setreuid(geteuid(), 0);
     if ((ioctl(term, VT_UNLOCKSWITCH)) == -1) {
         perror("error unlocking console");
@@ -741,15 +2477,26 @@ main(int argc, char **argv) {
     close(term);
     setuid(getuid()); // drop rights permanently
 
-    XUngrabPointer(dpy, CurrentTime);
-    XFreePixmap(dpy, pmap);
-	if (use_b_image)
-		XFreePixmap(dpy, bg);
-	if (use_e_b_image)
-    	XFreePixmap(dpy, p);
-    XFreeFont(dpy, font);
-    XFreeGC(dpy, gc);
-    XDestroyWindow(dpy, w);
-    XCloseDisplay(dpy);
+    for (int i = 0; i < nlocks; i++) {
+        use_lock(i);
+        XUngrabPointer(dpy, CurrentTime);
+        XFreePixmap(dpy, pmap);
+        free_background(&normal_bg);
+        free_background(&error_bg);
+        XftColorFree(dpy, DefaultVisual(dpy, screen), \
+            DefaultColormap(dpy, screen), &fgcolor);
+        if (atlas_pic != None) XRenderFreePicture(dpy, atlas_pic);
+        XftDrawDestroy(xftdraw);
+        XftFontClose(dpy, font);
+        XFreeGC(dpy, gc);
+        XFreeGC(dpy, bggc);
+        XFreePixmap(dpy, backbuf);
+        XDestroyRegion(damage);
+        XDestroyWindow(dpy, w);
+    }
+    img_free(&normal_img);
+    img_free(&error_img);
+    for (int d = 0; d < ndisplays; d++)
+        XCloseDisplay(locks[display_locks[d]].dpy);
     return 0;
 }
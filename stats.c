@@ -0,0 +1,143 @@
+/* See LICENSE file for license details. */
+#ifdef STATS
+#define _XOPEN_SOURCE 500
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/*
+ * Bucket 0 counts stages that took under 1 us, bucket i those that took
+ * [2^(i-1), 2^i) us. The last one also takes anything slower.
+ */
+#define NBUCKETS 24
+
+static const char *stage_names[StLast] = {
+	"dequeue", "decode", "auth", "layout", "render", "flush"
+};
+static const char *counter_names[CtLast] = {
+	"wakeups", "events", "redraws", "name reads", "round trips"
+};
+
+static struct {
+	long long n, total, max;  /* ns */
+	long long buckets[NBUCKETS];
+} stages[StLast];
+static long long counters[CtLast];
+static long long started;
+static FILE *out;        /* $SFLOCK_STATS, or stderr */
+static int sigpipe[2];   /* SIGUSR1 -> main loop */
+
+long long
+stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_add(int stage, long long ns) {
+	long long us = ns / 1000;
+	int b = 0;
+
+	while (us && b < NBUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	stages[stage].n++;
+	stages[stage].total += ns;
+	if (ns > stages[stage].max) stages[stage].max = ns;
+	stages[stage].buckets[b]++;
+}
+
+void
+stats_count(int counter) {
+	counters[counter]++;
+}
+
+void
+stats_debug(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(out, fmt, ap);
+	va_end(ap);
+}
+
+static void
+print_stats(void) {
+	double secs = (stats_now() - started) / 1e9;
+
+	fprintf(out, "sflock stats after %.1f s\n", secs);
+	for (int i = 0; i < CtLast; i++)
+		fprintf(out, "  %-12s %lld (%.1f/s)\n", counter_names[i], \
+			counters[i], counters[i] / secs);
+	for (int i = 0; i < StLast; i++) {
+		if (!stages[i].n) continue;
+		fprintf(out, "  %-12s n=%lld mean=%lldus max=%lldus\n    ", \
+			stage_names[i], stages[i].n, \
+			stages[i].total / stages[i].n / 1000, stages[i].max / 1000);
+		for (int b = 0; b < NBUCKETS; b++)
+			if (stages[i].buckets[b])
+				fprintf(out, " <%dus:%lld", 1 << b, stages[i].buckets[b]);
+		fprintf(out, "\n");
+	}
+	fflush(out);
+}
+
+static void
+on_usr1(int sig) {
+	int saved = errno;
+
+	if (write(sigpipe[1], "", 1) == -1) { /* full pipe, a dump is pending */ }
+	errno = saved;
+}
+
+/*
+ * Sets up the output and the SIGUSR1 handler, and dumps once more at
+ * exit. Returns an fd for the main loop to watch; it becomes readable
+ * when a dump was asked for, stats_dump() then prints it.
+ */
+int
+stats_init(void) {
+	const char *path = getenv("SFLOCK_STATS");
+	struct sigaction sa;
+
+	started = stats_now();
+	out = stderr;
+	if (path && !(out = fopen(path, "a"))) {
+		fprintf(stderr, "warning: could not open %s, stats go to stderr\n", \
+			path);
+		out = stderr;
+	}
+	if (pipe(sigpipe) == -1) return -1;
+	fcntl(sigpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sigpipe[1], F_SETFL, O_NONBLOCK);
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = on_usr1;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(print_stats);
+	return sigpipe[0];
+}
+
+void
+stats_dump(int fd) {
+	char buf[16];
+
+	while (read(fd, buf, sizeof buf) > 0);
+	print_stats();
+}
+#else
+/* ISO C doesn't allow an empty translation unit */
+typedef int stats_unused;
+#endif
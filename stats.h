@@ -0,0 +1,30 @@
+/* See LICENSE file for license details. */
+
+/*
+ * Instrumentation, only built with -DSTATS (see config.mk). Without it
+ * every macro below expands to nothing and stats.c is empty.
+ */
+
+/* Stages whose latency is recorded */
+enum { StDequeue, StDecode, StAuth, StLayout, StRender, StFlush, StLast };
+/* Things that are counted */
+enum { CtWakeup, CtEvent, CtRedraw, CtNameRead, CtRoundTrip, CtLast };
+
+#ifdef STATS
+#define STAT_START(t)      long long t = stats_now()
+#define STAT_END(stage, t) stats_add(stage, stats_now() - (t))
+#define STAT_COUNT(c)      stats_count(c)
+#define DEBUG(...)         stats_debug(__VA_ARGS__)
+
+long long stats_now(void);
+void stats_add(int stage, long long ns);
+void stats_count(int counter);
+void stats_debug(const char *fmt, ...);
+int stats_init(void);
+void stats_dump(int fd);
+#else
+#define STAT_START(t)
+#define STAT_END(stage, t)
+#define STAT_COUNT(c)
+#define DEBUG(...)
+#endif